@@ -0,0 +1,475 @@
+/*
+ *  Lekhani: A text editor
+ *  Copyright (C) 2025  Khethan R G
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ * 
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see https://www.gnu.org/licenses/.
+ * 
+ *  Full license: https://github.com/khethan-god/Lekhani/blob/main/LICENSE
+ */
+
+/*
+ * ptybench: runs the editor under a pseudo-terminal and plays the part of
+ * the terminal. Replays scripted key sequences and reports keystroke to
+ * frame latency percentiles, bytes written per frame, read/write syscalls
+ * per key, and how often a real terminal would repaint.
+ *
+ *   ./bench/ptybench ./lekhani
+ *
+ * The editor runs with LEKHANI_FPS=1000 unless the variable is already
+ * set, so latencies measure key handling and frame building rather than
+ * the frame rate cap.
+ */
+
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 600
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+/*** Constants ***/
+#define SCREEN_ROWS 50
+#define SCREEN_COLS 120
+#define FIXTURE_LINES 20000
+#define READ_CHUNK 1024     // Bytes a terminal consumes before it may repaint
+#define FRAME_TIMEOUT_MS 2000
+#define PAGE_DOWN_KEYS 200
+#define LINE_SCROLL_KEYS 200
+#define QUIET_MS 200        // Output silence that marks the end of a paste
+#define PASTE_BYTES (64 * 1024)
+
+/*** Data Structures ***/
+struct session {
+    pid_t pid;          // Editor process
+    int fd;             // Master side of the pseudo-terminal
+    bool sync;          // Whether the stand-in advertises mode 2026
+    char *out;          // Everything the editor wrote
+    size_t len;         // Length of out
+    size_t scanned;     // Bytes of out already parsed
+    bool inFrame;       // A frame has started but not finished
+    long frames;        // Completed frames
+    long repaints;      // Times the terminal would have repainted
+    long torn;          // Repaints that showed a partly drawn frame
+    uint64_t lastFrameNs; // When the last frame completed
+};
+
+struct scenario {
+    const char *name;   // Name shown in the report
+    const char *const *keys; // Keys sent one at a time, NULL terminated
+    int repeat;         // Times the key list is replayed
+};
+
+/*** Error Handling ***/
+
+/*
+ * Prints an error message to stderr and exits with failure status.
+ * Args:
+ *   msg - The error message to display before the system error description.
+ */
+static void die(const char *msg) {
+    perror(msg);
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * Reads the monotonic clock.
+ * Returns:
+ *   The current monotonic time in nanoseconds.
+ */
+static uint64_t monotonicNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*** Pseudo-terminal Stand-in ***/
+
+/*
+ * Starts the editor on a new pseudo-terminal.
+ * Args:
+ *   s - Session to initialize.
+ *   editor - Path of the editor binary.
+ *   file - File to open in the editor.
+ *   sync - Whether to answer the synchronized output query as supported.
+ */
+static void sessionStart(struct session *s, const char *editor, const char *file, bool sync) {
+    memset(s, 0, sizeof(*s));
+    s->sync = sync;
+
+    s->fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (s->fd == -1 || grantpt(s->fd) == -1 || unlockpt(s->fd) == -1) die("posix_openpt");
+    struct winsize ws = {SCREEN_ROWS, SCREEN_COLS, 0, 0};
+    if (ioctl(s->fd, TIOCSWINSZ, &ws) == -1) die("ioctl");
+
+    char *slave = ptsname(s->fd);
+    s->pid = fork();
+    if (s->pid == -1) die("fork");
+    if (s->pid == 0) {
+        setsid();
+        int sfd = open(slave, O_RDWR);
+        if (sfd == -1) die("open");
+        ioctl(sfd, TIOCSCTTY, 0);
+        dup2(sfd, STDIN_FILENO);
+        dup2(sfd, STDOUT_FILENO);
+        dup2(sfd, STDERR_FILENO);
+        close(sfd);
+        close(s->fd);
+        setenv("LEKHANI_FPS", "1000", 0);
+        execl(editor, editor, file, (char *)NULL);
+        _exit(127);
+    }
+}
+
+/*
+ * Answers terminal queries found in freshly received output.
+ */
+static void sessionAnswerQueries(struct session *s, const char *d, size_t n) {
+    if (memmem(d, n, "\x1b[?2026$p", 9) && s->sync) {
+        write(s->fd, "\x1b[?2026;2$y", 11);
+    }
+    if (memmem(d, n, "\x1b[c", 3)) {
+        write(s->fd, "\x1b[?62;22c", 9);
+    }
+}
+
+/*
+ * Parses newly received output for frame boundaries. In synchronized mode
+ * frames are bracketed by mode 2026 set/reset, otherwise by the cursor
+ * hide/show pair.
+ */
+static void sessionScan(struct session *s) {
+    const char *begin = s->sync ? "\x1b[?2026h" : "\x1b[?25l";
+    const char *end = s->sync ? "\x1b[?2026l" : "\x1b[?25h";
+    size_t blen = strlen(begin), elen = strlen(end);
+
+    while (s->scanned < s->len) {
+        const char *p = s->out + s->scanned;
+        size_t left = s->len - s->scanned;
+        const char *mark = s->inFrame ? end : begin;
+        size_t mlen = s->inFrame ? elen : blen;
+        const char *hit = memmem(p, left, mark, mlen);
+        if (hit == NULL) {
+            // Keep a possibly split marker for the next chunk
+            s->scanned = left > mlen ? s->len - mlen + 1 : s->scanned;
+            return;
+        }
+        s->scanned = (hit - s->out) + mlen;
+        if (s->inFrame) {
+            s->frames++;
+            s->lastFrameNs = monotonicNs();
+        }
+        s->inFrame = !s->inFrame;
+    }
+}
+
+/*
+ * Reads output the way a terminal does: a chunk at a time, repainting
+ * after each chunk unless a synchronized update is still open.
+ * Args:
+ *   s - The session.
+ *   timeoutMs - How long to wait for the first chunk.
+ * Returns:
+ *   false if nothing arrived before the timeout.
+ */
+static bool sessionPump(struct session *s, int timeoutMs) {
+    struct pollfd pfd = {s->fd, POLLIN, 0};
+    if (poll(&pfd, 1, timeoutMs) <= 0) return false;
+
+    char chunk[READ_CHUNK];
+    ssize_t n = read(s->fd, chunk, sizeof(chunk));
+    if (n <= 0) return false;
+    sessionAnswerQueries(s, chunk, n);
+
+    char *grown = realloc(s->out, s->len + n);
+    if (grown == NULL) die("realloc");
+    s->out = grown;
+    memcpy(s->out + s->len, chunk, n);
+    s->len += n;
+    sessionScan(s);
+
+    if (!(s->sync && s->inFrame)) {
+        s->repaints++;
+        if (s->inFrame) s->torn++;
+    }
+    return true;
+}
+
+/*
+ * Waits until the editor has completed `frames` frames in total.
+ */
+static bool sessionWaitFrames(struct session *s, long frames) {
+    while (s->frames < frames) {
+        if (!sessionPump(s, FRAME_TIMEOUT_MS)) return false;
+    }
+    return true;
+}
+
+/*
+ * Reads the editor's read and write syscall counters from /proc.
+ * Returns:
+ *   syscr + syscw, or -1 when /proc/<pid>/io is unavailable.
+ */
+static long sessionSyscalls(struct session *s) {
+    char path[64], line[128];
+    long total = -1, value;
+    snprintf(path, sizeof(path), "/proc/%d/io", (int)s->pid);
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) return -1;
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "syscr: %ld", &value) == 1 || sscanf(line, "syscw: %ld", &value) == 1) {
+            total = (total == -1 ? 0 : total) + value;
+        }
+    }
+    fclose(fp);
+    return total;
+}
+
+/*
+ * Quits the editor and releases the session. Ctrl-Q is sent twice, as an
+ * edited document asks for confirmation; an editor that does not exit
+ * cleanly is reported and terminated.
+ */
+static void sessionClose(struct session *s) {
+    write(s->fd, "\x11\x11", 2); // Ctrl-Q Ctrl-Q
+    while (sessionPump(s, 200));
+
+    int status = 0;
+    pid_t done = 0;
+    for (int waited = 0; waited < FRAME_TIMEOUT_MS && done == 0; waited += 10) {
+        done = waitpid(s->pid, &status, WNOHANG);
+        if (done == 0) poll(NULL, 0, 10);
+    }
+    if (done != s->pid) {
+        fprintf(stderr, "editor did not quit on Ctrl-Q\n");
+        kill(s->pid, SIGTERM);
+        waitpid(s->pid, NULL, 0);
+    } else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "editor quit with status %d\n", status);
+    }
+    close(s->fd);
+    free(s->out);
+}
+
+/*** Scenarios ***/
+
+static const char *const typingKeys[] = {
+    "T", "h", "e", " ", "q", "u", "i", "c", "k", " ", "f", "o", "x", "\x1b[B", NULL
+};
+static const char *const pagingKeys[] = {
+    "\x1b[6~", "\x1b[6~", "\x1b[6~", "\x1b[5~", NULL
+};
+static const char *const gotoKeys[] = {
+    "\x07", "1", "5", "0", "0", "0", "\r", "\x07", "5", "0", "%", "\r", NULL  // Ctrl-G 15000, 50%
+};
+static const char *const cursorKeys[] = {
+    "\x1b[C", "\x1b[C", "\x1b[B", "\x1b[F", "\x1b[H", "\x1b[A", NULL
+};
+
+static const struct scenario scenarios[] = {
+    {"typing", typingKeys, 20},
+    {"paging", pagingKeys, 50},
+    {"goto", gotoKeys, 20},
+    {"cursor", cursorKeys, 40},
+};
+
+static int compareU64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Prints one report line from a set of keystroke-to-frame latencies.
+ */
+static void report(const char *name, uint64_t *lat, int n, long frames,
+                   size_t bytes, long syscalls, int keys) {
+    qsort(lat, n, sizeof(*lat), compareU64);
+    double ms = 1e-6;
+    printf("%-10s keys %5d  p50 %7.3f  p90 %7.3f  p99 %7.3f  max %7.3f ms  "
+           "%8.1f bytes/frame  ",
+           name, keys, n ? lat[n / 2] * ms : 0, n ? lat[n * 9 / 10] * ms : 0,
+           n ? lat[n * 99 / 100] * ms : 0, n ? lat[n - 1] * ms : 0,
+           frames ? (double)bytes / frames : 0.0);
+    if (syscalls >= 0) printf("%5.1f syscalls/key\n", (double)syscalls / keys);
+    else printf("  n/a syscalls/key\n");
+}
+
+/*
+ * Replays a scenario one key at a time, timing each key until the frame
+ * that reflects it has been received in full.
+ */
+static void benchScenario(const char *editor, const char *file, const struct scenario *sc) {
+    struct session s;
+    sessionStart(&s, editor, file, false);
+    if (!sessionWaitFrames(&s, 1)) die("first frame");
+
+    int nkeys = 0;
+    while (sc->keys[nkeys]) nkeys++;
+    int total = nkeys * sc->repeat, n = 0;
+    uint64_t *lat = malloc(total * sizeof(*lat));
+    if (lat == NULL) die("malloc");
+
+    size_t bytes = s.len;
+    long frames = s.frames, syscalls = sessionSyscalls(&s);
+    for (int i = 0; i < total; i++) {
+        const char *key = sc->keys[i % nkeys];
+        uint64_t start = monotonicNs();
+        write(s.fd, key, strlen(key));
+        if (!sessionWaitFrames(&s, s.frames + 1)) break;
+        lat[n++] = s.lastFrameNs - start;
+    }
+    long after = sessionSyscalls(&s);
+
+    report(sc->name, lat, n, s.frames - frames, s.len - bytes,
+           syscalls >= 0 && after >= 0 ? after - syscalls : -1, n);
+    free(lat);
+    sessionClose(&s);
+}
+
+/*
+ * Pastes a large block in one write and times it until the editor has
+ * drawn its last frame and gone quiet.
+ */
+static void benchPaste(const char *editor, const char *file) {
+    struct session s;
+    sessionStart(&s, editor, file, false);
+    if (!sessionWaitFrames(&s, 1)) die("first frame");
+
+    char *paste = malloc(PASTE_BYTES);
+    if (paste == NULL) die("malloc");
+    for (int i = 0; i < PASTE_BYTES; i++) paste[i] = "paste me "[i % 9];
+
+    size_t bytes = s.len;
+    long frames = s.frames, syscalls = sessionSyscalls(&s);
+    uint64_t start = monotonicNs();
+    for (size_t off = 0; off < PASTE_BYTES;) {
+        ssize_t w = write(s.fd, paste + off, PASTE_BYTES - off);
+        if (w > 0) off += w;
+        else while (sessionPump(&s, 10)); // Input queue full: let output drain
+    }
+    while (sessionPump(&s, QUIET_MS));
+    uint64_t lat = s.lastFrameNs - start;
+    long after = sessionSyscalls(&s);
+
+    report("pasting", &lat, 1, s.frames - frames, s.len - bytes,
+           syscalls >= 0 && after >= 0 ? after - syscalls : -1, PASTE_BYTES);
+    free(paste);
+    sessionClose(&s);
+}
+
+/*
+ * Writes a fixture file of numbered lines.
+ * Args:
+ *   path - Template for mkstemp, replaced with the actual path.
+ */
+static void writeFixture(char *path) {
+    int fd = mkstemp(path);
+    if (fd == -1) die("mkstemp");
+    FILE *fp = fdopen(fd, "w");
+    if (fp == NULL) die("fdopen");
+    for (int i = 1; i <= FIXTURE_LINES; i++) {
+        fprintf(fp, "%6d\tThe quick brown fox jumps over the lazy dog; "
+                    "pack my box with five dozen liquor jugs.\n", i);
+    }
+    fclose(fp);
+}
+
+/*
+ * Pages through the fixture one key at a time and reports repaints.
+ */
+static void benchRepaints(const char *editor, const char *file, bool sync) {
+    struct session s;
+    sessionStart(&s, editor, file, sync);
+    if (!sessionWaitFrames(&s, 1)) die("first frame");
+
+    long repaints = s.repaints, torn = s.torn, frames = s.frames;
+    for (int i = 0; i < PAGE_DOWN_KEYS; i++) {
+        write(s.fd, "\x1b[6~", 4);
+        if (!sessionWaitFrames(&s, s.frames + 1)) break;
+    }
+    frames = s.frames - frames;
+    repaints = s.repaints - repaints;
+    torn = s.torn - torn;
+
+    printf("%-22s frames %5ld  repaints %5ld  torn repaints %5ld  (%.2f repaints/frame)\n",
+           sync ? "synchronized output" : "hide/show cursor",
+           frames, repaints, torn, frames ? (double)repaints / frames : 0.0);
+    sessionClose(&s);
+}
+
+/*
+ * Scrolls the view one line at a time and reports bytes per frame.
+ */
+static void benchLineScroll(const char *editor, const char *file) {
+    struct session s;
+    sessionStart(&s, editor, file, false);
+    if (!sessionWaitFrames(&s, 1)) die("first frame");
+
+    // Walk the cursor to the last screen row so every further key scrolls
+    for (int i = 0; i < SCREEN_ROWS - 1; i++) {
+        write(s.fd, "\x1b[B", 3);
+        if (!sessionWaitFrames(&s, s.frames + 1)) break;
+    }
+
+    size_t bytes = s.len;
+    long frames = s.frames;
+    for (int i = 0; i < LINE_SCROLL_KEYS; i++) {
+        write(s.fd, "\x1b[B", 3);
+        if (!sessionWaitFrames(&s, s.frames + 1)) break;
+    }
+    frames = s.frames - frames;
+    bytes = s.len - bytes;
+
+    printf("%-22s frames %5ld  bytes %8zu  (%.1f bytes/frame)\n", "line scroll",
+           frames, bytes, frames ? (double)bytes / frames : 0.0);
+    sessionClose(&s);
+}
+
+/*** Entry Point ***/
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <editor>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    char fixture[] = "/tmp/lekhani-bench-XXXXXX";
+    writeFixture(fixture);
+
+    printf("Keystroke to frame latency on a %dx%d terminal:\n", SCREEN_ROWS, SCREEN_COLS);
+    for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+        benchScenario(argv[1], fixture, &scenarios[i]);
+    }
+    benchPaste(argv[1], fixture);
+
+    printf("Page down x%d, terminal repaints:\n", PAGE_DOWN_KEYS);
+    benchRepaints(argv[1], fixture, false);
+    benchRepaints(argv[1], fixture, true);
+    printf("Arrow down x%d past the bottom of the screen:\n", LINE_SCROLL_KEYS);
+    benchLineScroll(argv[1], fixture);
+
+    unlink(fixture);
+    return EXIT_SUCCESS;
+}
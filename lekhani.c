@@ -18,15 +18,36 @@
  *  Full license: https://github.com/khethan-god/Lekhani/blob/main/LICENSE
  */
 
+#define _DEFAULT_SOURCE
+#define _BSD_SOURCE
+#define _GNU_SOURCE
+
 #include <ctype.h>
 #include <errno.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <time.h>
 #include <termios.h>
 #include <stdbool.h>
+#include <limits.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 /*** Constants ***/
 static const char *VERSION = "0.0.1";
@@ -36,9 +57,57 @@ static const char *LICENSE_URL = "https://github.com/khethan-god/Lekhani/blob/ma
 /*** Macros ***/
 #define CTRL_KEY(k) ((k) & 0x1f)
 #define ABUF_INIT {NULL, 0}
+#define TAB_STOP 8
+#define ASCII_CHUNK 16  // Bytes classified at once by the printable-ASCII fast path
+#define RENDER_CACHE_ENTRIES 1024
+#define RENDER_CACHE_BUCKETS 2048   // Power of two
+#define RENDER_CACHE_MAX_BYTES (32 * 1024 * 1024)
+#define DEFAULT_FPS 60
+#define NSEC_PER_SEC 1000000000ULL
+#define NSEC_PER_MSEC 1000000ULL
+#define TERMINAL_QUERY_TIMEOUT_MS 500
+#define HUD_ROWS 6
+#define HUD_WIDTH 34
+#define HUD_REFRESH_MS 1000
+#define TRACE_RING_EVENTS 65536     // Per thread, power of two
+#define TRACE_MAX_THREADS 16
+#define INPUT_LOG_MAGIC "LKR1"
+#define GZ_WINDOW 32768             // Deflate history needed to resume mid-stream
+#define GZ_SPAN (8 * 1024 * 1024)   // Uncompressed bytes between seek checkpoints
+#define GZ_PUBLISH_BYTES (1024 * 1024) // Rows are handed over after this much output
+#define GZ_CACHE_CHUNKS 4           // Decompressed spans kept for row access
+#define DEFAULT_MEMORY_MB 256
+#define RESIDENT_GRANULE (4 * 1024 * 1024) // Unit in which the mapping is paged out
+#define LINE_CACHE_MAGIC "LKLINE1"   // Start of a cached line index file
+#define LINE_CACHE_MIN_BYTES (64 * 1024 * 1024) // Smaller files are indexed quicker than cached
+#define LINE_CACHE_SAMPLE 4096       // Bytes hashed at each end of a file to recognize it
+#define SCAN_CHUNK 65536            // Bytes searched per step when looking for a row end
+#define PREFETCH_MAX_SCREENS 8      // Screens read ahead while paging in one direction
+#define MESSAGE_BAR_ROWS 1
+#define MESSAGE_TIMEOUT 5           // Seconds a status message stays up
+#define PROMPT_MAX 64
+#define BUFFER_MAX_LOADED 16        // Buffers kept mapped and indexed at once
+#define PANE_MAX 16
+#define CURSOR_DRAW_MAX 64          // Extra cursors highlighted on one screen row
+#define TABLE_SAMPLE_ROWS 64        // Rows at the head, and spread over the file, sized at once
+#define TABLE_MAX_WIDTH 40          // Widest a column is drawn; longer fields are cut
+#define TABLE_MAX_COLUMNS 1024      // Fields past this are drawn as part of the last one
+#define TABLE_SEPARATOR " | "
+#define TABLE_GAP 3                 // Width of TABLE_SEPARATOR
+#define BRACKET_CHUNK (16 * 1024)   // Bytes summarized per leaf of the bracket tree
+#define BRACKET_CHUNK_MAX (4 * BRACKET_CHUNK) // A leaf grown past this rebuilds the tree
+#define BRACKET_EAGER_BYTES (32 * 1024 * 1024) // Larger files are summarized on the first jump
+#define WORD_BLOCK 32                // Bytes classified at a time by word motion
+#define JSON_BLOCK 64               // Bytes classified at once by the structural scan
+#define JSON_COMMA_STRIDE 64        // Every this many commas in a container is indexed
+#define JSON_NONE UINT32_MAX        // No such mark
+#define JSON_KEY_SCAN 4096          // Bytes searched around a member for its key
+#define JSON_KEY_MAX 24             // Bytes of a key shown in a path
+#define JSON_PATH_MAX 32            // Innermost levels of a path that are shown
 
 /*** Enums ***/
 enum editorKey {
+    BACKSPACE = 127,
     ARROW_LEFT = 1000,
     ARROW_RIGHT,
     ARROW_UP,
@@ -47,14 +116,68 @@ enum editorKey {
     HOME_KEY,
     END_KEY,
     PAGE_UP,
-    PAGE_DOWN
+    PAGE_DOWN,
+    CTRL_ARROW_UP,      // Added last so recorded key codes keep their meaning
+    CTRL_ARROW_DOWN,
+    SHIFT_ARROW_UP,
+    SHIFT_ARROW_DOWN,
+    SHIFT_ARROW_RIGHT,
+    SHIFT_ARROW_LEFT,
+    CTRL_ARROW_RIGHT,
+    CTRL_ARROW_LEFT,
+    CTRL_SHIFT_ARROW_RIGHT,
+    CTRL_SHIFT_ARROW_LEFT
+};
+
+enum wordClass {
+    WORD_SPACE,
+    WORD_WORD,
+    WORD_PUNCT
 };
 
 /*** Data Structures ***/
 struct editorConfig {
-    int cx, cy;         // Cursor position
-    int screenRows;     // Number of rows in the terminal
-    int screenCols;     // Number of columns in the terminal
+    int cx;             // Cursor byte offset within the current row
+    long cy;            // Cursor row in the document
+    int rx;             // Cursor display column within the current row
+    long rowoff;        // First document row shown on screen
+    int coloff;         // First display column shown on screen
+    int screenRows;     // Number of rows in the active pane
+    int screenCols;     // Number of columns in the active pane
+    int termRows;       // Number of rows in the terminal
+    int termCols;       // Number of columns in the terminal
+    long numrows;       // Number of rows (lines) in the document
+    size_t *lineIdx;    // Start offset of about every (1 << M.indexShift)th row
+    long *lineRow;      // Row of each entry once edits moved them off the stride, else NULL
+    size_t lineSlots;   // Entries used in lineIdx
+    size_t lineCap;     // Entries allocated in lineIdx
+    size_t lineMapLen;  // Length of the cache file lineIdx is mapped from, 0 if allocated
+    char *map;          // Read-only mapping of the open file
+    size_t mapLen;      // Length of the mapping in bytes
+    size_t docLen;      // Length of the document, mapLen until it is edited
+    struct pieceTable *pt; // Edits made to the file, NULL while unmodified
+    int fd;             // Descriptor of the open file, -1 if none
+    char *filename;     // Name of the open file, NULL if none
+    struct gzDoc *gz;   // Decompression state for a gzip file, NULL otherwise
+    bool follow;        // Track appends to the file like tail -f
+    int inotifyFd;      // Watches the file while following, -1 otherwise
+    int fileWatch;      // Watch on the file itself, -1 after it went away
+    int dirWatch;       // Watch on the file's directory, for rotation
+    bool dirty;         // The screen needs a new frame
+    unsigned long version; // Bumped whenever the document content changes
+    uint64_t frameInterval; // Minimum time between frames (ns)
+    uint64_t lastFrame;     // Monotonic time the last frame was started (ns)
+    uint64_t writeLatency;  // Smoothed time from frame submit to flushed (ns)
+    bool syncOutput;    // Terminal supports synchronized output (mode 2026)
+    bool hud;           // Performance overlay is visible
+    int pageStreak;     // Consecutive page moves, negative while paging up
+    bool quitConfirm;   // Ctrl-Q was pressed once with edits unsaved
+    char statusmsg[80]; // Message shown in the message bar
+    time_t statusmsgTime; // When statusmsg was set
+    const char *promptLabel; // Prompt format (%s is the input), NULL when not prompting
+    char promptBuf[PROMPT_MAX]; // Input typed at the prompt
+    int promptLen;      // Length of promptBuf
+    void (*promptDone)(const char *input); // Called with the input on Enter
     struct termios orig_termios; // Original terminal settings
 };
 
@@ -63,8 +186,335 @@ struct abuf {
     int len;            // Buffer length
 };
 
+struct perfStats {
+    uint64_t abBytes;   // Bytes passed to abAppend during the current frame
+    uint64_t abAllocs;  // Reallocations made by abAppend during the current frame
+    uint64_t writeNs;   // Time spent in write() for the frame being flushed
+    uint64_t lastBuildNs;   // Time taken to build the last frame
+    int lastFrameBytes;     // Size of the last frame
+    uint64_t lastAbBytes;   // abBytes of the last frame
+    uint64_t lastAbAllocs;  // abAllocs of the last frame
+    uint64_t lastWriteNs;   // writeNs of the last fully flushed frame
+    int inputDepth;     // Bytes waiting on stdin when the frame started
+    long rssKb;         // Resident set size when the frame started
+};
+
+struct traceEvent {
+    const char *name;   // Span name, a string literal
+    uint64_t start;     // Monotonic start time (ns)
+    uint64_t dur;       // Duration (ns)
+    long arg;           // Key code or byte count, shown in the trace viewer
+};
+
+struct traceRing {
+    int tid;            // Thread id reported in the trace
+    uint64_t head;      // Events ever recorded; only the owning thread writes it
+    struct traceEvent events[TRACE_RING_EVENTS];
+};
+
+struct traceState {
+    bool enabled;       // Spans are being recorded
+    char *path;         // Where the trace is written on exit
+    int nrings;         // Rings registered so far
+    struct traceRing *rings[TRACE_MAX_THREADS];
+};
+
+struct inputLog {
+    FILE *fp;           // Recording being written or replayed, NULL when off
+    bool replay;        // Keys come from the recording instead of the terminal
+    uint64_t last;      // Time of the previous recorded key (ns)
+    uint64_t recordedUs; // Replay: time the recorded session took (us)
+    char *path;         // Name of the recording
+};
+
+struct screenLine {
+    char *b;            // Bytes last drawn on the row, without the clear
+    int len;            // Length of b, -1 if the row's content is unknown
+};
+
+struct pane {
+    int top;            // Screen row of the pane's first row
+    int left;           // Screen column of the pane's first column
+    int rows;           // Height of the pane
+    int cols;           // Width of the pane
+    int cx;             // View; E holds it while the pane is the active one
+    long cy;
+    int rx;
+    long rowoff;
+    int coloff;
+    struct screenLine *shadow; // What each row of the pane currently shows
+    long drawnRowoff;   // rowoff the shadow was drawn at
+    int drawnColoff;    // coloff the shadow was drawn at, -1 to force a redraw
+};
+
+struct paneLayout {
+    struct pane panes[PANE_MAX];
+    int npanes;
+    int active;         // Pane whose view is in E
+    bool prefix;        // Ctrl-W was pressed; the next key is a pane command
+    bool separatorsDrawn; // The lines between panes are on screen
+    struct screenLine bar; // What the message bar currently shows
+};
+
+struct widthRange {
+    uint32_t first;     // First codepoint of the range
+    uint32_t last;      // Last codepoint of the range (inclusive)
+};
+
+struct outputWriter {
+    int fd;             // Terminal output, non-blocking when it could be reopened
+    char *frame;        // Frame being written, NULL when idle
+    int len;            // Length of frame
+    int off;            // Bytes of frame already written
+    uint64_t submitted; // Monotonic time frame was submitted (ns)
+    char *queued;       // Newest frame waiting for frame to finish, or NULL
+    int queuedLen;      // Length of queued
+    uint64_t queuedAt;  // Monotonic time queued was submitted (ns)
+    unsigned long dropped; // Frames replaced before any byte was written
+};
+
+struct gzPoint {
+    size_t out;         // Uncompressed offset the checkpoint resumes at
+    size_t in;          // Compressed offset of the first whole byte to read
+    int bits;           // Bits of the byte before in that still belong to the stream
+    unsigned char *window; // Last GZ_WINDOW bytes of output before out
+};
+
+struct gzChunk {
+    long point;         // Checkpoint the chunk was inflated from, -1 if unused
+    size_t out;         // Uncompressed offset of data[0]
+    char *data;         // Uncompressed bytes from that checkpoint on
+    size_t len;         // Length of data
+    unsigned long used; // Access tick, for eviction
+};
+
+struct gzDoc {
+    const unsigned char *src; // Compressed file contents (mapped)
+    size_t srcLen;      // Length of src
+    pthread_t thread;   // Background pass building the index
+    pthread_mutex_t lock; // Guards everything the two threads share below
+    struct gzPoint *points; // Seek checkpoints, in order
+    long npoints;
+    long pointCap;
+    size_t *starts;     // Row starts found but not yet taken by the editor
+    size_t nstarts;
+    size_t startCap;
+    size_t indexed;     // Uncompressed bytes covered by rows handed over so far
+    bool done;          // The background pass has finished
+    bool stop;          // Asks the background pass to quit early
+    int notify[2];      // Pipe the background pass pokes when there are new rows
+    struct gzChunk cache[GZ_CACHE_CHUNKS]; // Editor thread only
+    unsigned long tick; // Access counter for cache
+    char *scratch;      // Rows that straddle two chunks are copied here
+    size_t scratchCap;
+};
+
+struct memoryBudget {
+    size_t limit;       // Bytes the document may keep in memory
+    int indexShift;     // The line index holds every (1 << indexShift)th row
+    size_t *resident;   // Granules of the mapping that may stay paged in
+    uint64_t *residentUsed; // Access tick of each resident granule
+    int nresident;      // Entries in resident
+    int maxResident;    // Granules that fit in the mapping's share of limit
+    size_t lastGranule; // Granule touched last, SIZE_MAX if none
+    uint64_t tick;      // Access counter for residentUsed
+    long scanRow;       // Row whose start was resolved last, -1 if none
+    size_t scanOff;     // Start offset of scanRow
+};
+
+struct buffer {
+    const char *path;   // Path as given on the command line (points into argv)
+    dev_t dev;          // Identity and version of the file when it was added
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    bool loaded;        // Mapped and indexed; the fields below are valid
+    char *map;          // Document state, parked here while another buffer is shown
+    size_t mapLen;
+    int fd;
+    struct gzDoc *gz;
+    struct pieceTable *pt;
+    size_t *lineIdx;
+    long *lineRow;
+    size_t lineSlots;
+    size_t lineCap;
+    size_t lineMapLen;
+    long numrows;
+    int indexShift;
+    int cx;             // View, kept even after the buffer is evicted
+    long cy;
+    long rowoff;
+    int coloff;
+    bool table;         // Drawn in table mode
+    uint64_t lastViewed; // Switch counter when last shown, for eviction
+};
+
+struct bufferList {
+    struct buffer *bufs; // One per distinct file on the command line
+    int nbufs;
+    int current;        // Buffer shown, -1 before the first is opened
+    int nloaded;        // Buffers with loaded set
+    int *hash;          // Open addressing on (dev, ino), -1 for empty slots
+    int hashSize;       // Power of two
+    uint64_t tick;      // Switch counter
+};
+
+struct piece {
+    size_t start;       // Document offset of the piece's first byte
+    size_t off;         // Offset of the bytes in the mapping or the add buffer
+    size_t len;         // Length of the piece
+    bool add;           // Bytes come from the add buffer rather than the file
+};
+
+struct pieceTable {
+    struct piece *pieces; // In document order
+    size_t npieces;
+    char *add;          // Every byte ever inserted, appended in order
+    size_t addLen;
+    size_t addCap;
+    size_t len;         // Length of the document
+    char *scratch;      // Copy of a range that spans pieces
+    size_t scratchCap;
+};
+
+struct edit {
+    size_t off;         // Document offset the edit applies at
+    size_t del;         // Bytes removed from off
+    size_t ins;         // Offset of the inserted bytes in the add buffer
+    size_t insLen;      // Number of inserted bytes
+};
+
+struct cursorSet {
+    size_t *offs;       // Document offsets of the cursors besides E's, sorted
+    size_t n;
+    size_t cap;
+    char *typed;        // Text typed since the last edit was applied
+    size_t typedLen;
+    size_t typedCap;
+    bool block;         // A block selection spans from the anchor to E's cursor
+    long blockRow;      // Anchor corner of the block selection
+    int blockRx;
+    char *clip;         // Block copied with Ctrl-C, its rows separated by newlines
+    size_t clipLen;
+    size_t clipCap;
+};
+
+struct tableLayout {
+    bool on;            // Rows are drawn as aligned fields
+    char delim;         // Field delimiter
+    int *widths;        // Display width of each column
+    int ncols;          // Columns with a width so far
+    int colCap;
+    int *ends;          // Offsets just past each field of the last row split
+    int endsCap;
+};
+
+struct lineCacheHeader {
+    char magic[8];          // LINE_CACHE_MAGIC
+    uint64_t dev, ino;      // Identity of the file indexed
+    uint64_t size;          // Its length and modification time then
+    uint64_t mtimeSec, mtimeNsec;
+    uint64_t headHash;      // Hashes of the first and last bytes of that length
+    uint64_t tailHash;
+    uint64_t numrows;
+    uint64_t indexShift;
+    uint64_t slots;         // Index entries that follow
+};
+
+struct bracketNode {
+    size_t len;         // Bytes covered
+    int32_t delta[3];   // Opening minus closing brackets, per kind: (), [], {}
+    int32_t minPrefix[3]; // Lowest running delta from the start, at most 0
+};
+
+struct bracketIndex {
+    struct bracketNode *nodes; // Segment tree over the chunks, leaves from size on
+    size_t size;        // Leaves, a power of two
+    bool built;
+    unsigned long version; // Document version and length the tree is for
+    size_t len;
+    size_t *dirty;      // Leaves an edit batch changed, to summarize again
+    size_t ndirty;
+    size_t dirtyCap;
+    long hlRow[2];      // Brackets to mark: the match and the one before the cursor
+    int hlRx[2];
+    int nhl;
+};
+
+struct fold {
+    long first;         // Row shown for the fold, the rows after it are hidden
+    long last;          // Last hidden row
+    size_t firstOff;    // Where the rows start, kept across an edit batch
+    size_t lastOff;
+};
+
+struct foldSet {
+    struct fold *folds; // Disjoint, in row order
+    long *hidden;       // Rows hidden by the folds before each one, n + 1 entries
+    size_t n;
+    size_t cap;
+};
+
+struct jsonMark {
+    size_t off;         // Offset of the bracket or comma
+    uint32_t match;     // Index of the matching bracket, JSON_NONE if unmatched
+    uint32_t parent;    // Index of the enclosing open bracket, JSON_NONE at the top
+    uint32_t ordinal;   // Element of the parent a bracket is in, or that a comma starts
+    char c;             // The byte
+};
+
+struct jsonIndex {
+    struct jsonMark *marks; // Brackets outside strings, and every JSON_COMMA_STRIDE-th
+    uint32_t n;             // comma of a container, in document order
+    size_t cap;
+    bool built;
+    unsigned long version;  // Document version and length the marks are for
+    size_t len;
+    uint32_t *stack;    // Open brackets enclosing the scan position
+    uint32_t *commas;   // Commas seen so far in each of them
+    size_t depth;
+    size_t stackCap;
+    uint64_t inString;  // All ones while the scan is inside a string
+    uint64_t escaped;   // 1 if the next block starts with an escaped byte
+};
+
+struct renderEntry {
+    long row;           // Document row, -1 when the slot is free
+    unsigned long version; // Document version the render was built at
+    char *render;       // Row as drawn: tabs expanded, controls escaped
+    int rsize;          // Length of render
+    bool narrow;        // Every byte of render is exactly one column
+    int lruPrev;        // More recently used neighbour, -1 at the head
+    int lruNext;        // Less recently used neighbour, -1 at the tail
+    int hashNext;       // Next entry in the bucket (or free list), -1 at the end
+};
+
+struct renderCache {
+    struct renderEntry entries[RENDER_CACHE_ENTRIES];
+    int buckets[RENDER_CACHE_BUCKETS]; // First entry of each bucket, -1 if empty
+    int lruHead;        // Most recently used entry
+    int lruTail;        // Least recently used entry
+    int freeList;       // Evicted slots available for reuse
+    int used;           // Slots handed out at least once
+    size_t bytes;       // Total size of the cached renders
+};
+
 /*** Global Data ***/
 static struct editorConfig E;
+static struct renderCache RC;
+static struct outputWriter W;
+static struct perfStats P;
+static struct traceState T;
+static struct inputLog L;
+static struct memoryBudget M;
+static struct bufferList B;
+static struct paneLayout V;
+static struct cursorSet C;
+static struct tableLayout G;
+static struct jsonIndex J;
+static struct foldSet F;
+static struct bracketIndex K;
+static __thread struct traceRing *traceLocal; // Calling thread's ring
 
 /*** Append Buffer Functions ***/
 
@@ -76,6 +526,9 @@ static struct editorConfig E;
  *   len - Length of the string to append.
  */
 static void abAppend(struct abuf *ab, const char *s, int len) {
+    if (len <= 0) return; // realloc to zero bytes would free a reused buffer
+    P.abBytes += len;
+    P.abAllocs++;
     char *new = realloc(ab->b, ab->len + len);
     if (new == NULL) return;
     memcpy(&new[ab->len], s, len);
@@ -107,6 +560,234 @@ static void die(const char *msg) {
     exit(EXIT_FAILURE);
 }
 
+/*** Time Functions ***/
+
+/*
+ * Reads the monotonic clock.
+ * Returns:
+ *   The current monotonic time in nanoseconds.
+ */
+static uint64_t monotonicNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/*** Tracing ***/
+
+/*
+ * Starts a span.
+ * Returns:
+ *   The start time to pass to traceEnd, or 0 when tracing is off.
+ */
+static uint64_t traceBegin(void) {
+    return T.enabled ? monotonicNs() : 0;
+}
+
+/*
+ * Records a span in the calling thread's ring buffer. Each thread writes
+ * only its own ring, so recording takes no lock; the oldest events are
+ * overwritten once the ring is full.
+ * Args:
+ *   name - Span name, must be a string literal.
+ *   start - Value returned by traceBegin.
+ *   arg - Key code or byte count attached to the span.
+ */
+static void traceEnd(const char *name, uint64_t start, long arg) {
+    if (!T.enabled) return;
+    uint64_t now = monotonicNs();
+
+    struct traceRing *ring = traceLocal;
+    if (ring == NULL) {
+        // Claim a slot only while one is left, so nrings never passes the limit
+        int slot = __atomic_load_n(&T.nrings, __ATOMIC_ACQUIRE);
+        do {
+            if (slot >= TRACE_MAX_THREADS) return;
+        } while (!__atomic_compare_exchange_n(&T.nrings, &slot, slot + 1, false,
+                                              __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+        ring = calloc(1, sizeof(*ring));
+        if (ring == NULL) return;
+        ring->tid = slot + 1;
+        __atomic_store_n(&T.rings[slot], ring, __ATOMIC_RELEASE);
+        traceLocal = ring;
+    }
+
+    struct traceEvent *ev = &ring->events[ring->head & (TRACE_RING_EVENTS - 1)];
+    ev->name = name;
+    ev->start = start;
+    ev->dur = now - start;
+    ev->arg = arg;
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Writes the recorded spans as Chrome trace-event JSON, which Perfetto
+ * and chrome://tracing open directly. Registered with atexit.
+ */
+static void traceDump(void) {
+    FILE *fp = fopen(T.path, "w");
+    if (fp == NULL) return;
+
+    bool first = true;
+    int nrings = __atomic_load_n(&T.nrings, __ATOMIC_ACQUIRE);
+
+    fprintf(fp, "{\"traceEvents\":[");
+    for (int r = 0; r < nrings; r++) {
+        struct traceRing *ring = __atomic_load_n(&T.rings[r], __ATOMIC_ACQUIRE);
+        if (ring == NULL) continue;
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t tail = head > TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS : 0;
+        for (uint64_t i = tail; i < head; i++) {
+            struct traceEvent *ev = &ring->events[i & (TRACE_RING_EVENTS - 1)];
+            fprintf(fp, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                        "\"pid\":%d,\"tid\":%d,\"args\":{\"arg\":%ld}}",
+                    first ? "" : ",", ev->name, ev->start / 1000.0, ev->dur / 1000.0,
+                    (int)getpid(), ring->tid, ev->arg);
+            first = false;
+        }
+    }
+    fprintf(fp, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    fclose(fp);
+}
+
+/*
+ * Turns tracing on; the trace is written to path when the editor exits.
+ */
+static void traceEnable(const char *path) {
+    T.path = strdup(path);
+    if (T.path == NULL) return;
+    T.enabled = true;
+    atexit(traceDump);
+}
+
+/*** Input Recording ***/
+
+/*
+ * Recordings start with INPUT_LOG_MAGIC and the screen size as two
+ * little-endian 16-bit values, followed by one entry per key: the time
+ * since the previous key in microseconds and the zigzag-encoded key code,
+ * both as LEB128 varints. A typical key takes two or three bytes.
+ */
+
+/*
+ * Writes a value to the recording as an LEB128 varint: seven bits per
+ * byte, lowest first, with the top bit set on every byte but the last.
+ * Key codes are zigzag-encoded by the caller first, so the negative
+ * codes of raw bytes stay short.
+ * Args:
+ *   v - The value to write.
+ */
+static void inputLogPutVarint(uint64_t v) {
+    while (v >= 0x80) {
+        fputc((v & 0x7f) | 0x80, L.fp);
+        v >>= 7;
+    }
+    fputc(v, L.fp);
+}
+
+/*
+ * Reads an LEB128 varint written by inputLogPutVarint.
+ * Args:
+ *   v - Set to the value read.
+ * Returns:
+ *   true if a whole varint was read, false at EOF, including one cut
+ *   short, or when it runs past 64 bits.
+ */
+static bool inputLogGetVarint(uint64_t *v) {
+    int c, shift = 0;
+    *v = 0;
+    while ((c = fgetc(L.fp)) != EOF && shift < 64) {
+        *v |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80)) return true;
+        shift += 7;
+    }
+    return false;
+}
+
+/*
+ * Closes the recording, flushing what is buffered. Registered with
+ * atexit when recording starts.
+ */
+static void inputLogClose(void) {
+    if (L.fp) fclose(L.fp);
+    L.fp = NULL;
+}
+
+/*
+ * Starts recording decoded keys to a file.
+ * Args:
+ *   path - File to write the recording to.
+ */
+static void inputLogRecord(const char *path) {
+    L.fp = fopen(path, "wb");
+    if (L.fp == NULL) die("fopen");
+    L.path = strdup(path);
+    L.replay = false;
+    L.last = monotonicNs();
+    atexit(inputLogClose);
+}
+
+/*
+ * Writes the recording header; the screen size must be known by then.
+ */
+static void inputLogHeader(void) {
+    unsigned char hdr[8] = {0};
+    memcpy(hdr, INPUT_LOG_MAGIC, 4);
+    hdr[4] = E.termRows & 0xff;
+    hdr[5] = (E.termRows >> 8) & 0xff;
+    hdr[6] = E.termCols & 0xff;
+    hdr[7] = (E.termCols >> 8) & 0xff;
+    fwrite(hdr, 1, sizeof(hdr), L.fp);
+}
+
+/*
+ * Appends a key to the recording.
+ * Args:
+ *   key - The key code returned by editorReadKey.
+ */
+static void inputLogKey(int key) {
+    uint64_t now = monotonicNs();
+    inputLogPutVarint((now - L.last) / 1000);
+    inputLogPutVarint(((uint64_t)key << 1) ^ (uint64_t)(key >> (sizeof(int) * 8 - 1)));
+    L.last = now;
+}
+
+/*
+ * Opens a recording for replay and takes the screen size from it.
+ * Args:
+ *   path - File holding the recording.
+ */
+static void inputLogReplay(const char *path) {
+    unsigned char hdr[8];
+    L.fp = fopen(path, "rb");
+    if (L.fp == NULL) die("fopen");
+    L.path = strdup(path);
+    if (fread(hdr, 1, sizeof(hdr), L.fp) != sizeof(hdr) ||
+        memcmp(hdr, INPUT_LOG_MAGIC, 4) != 0) {
+        errno = EINVAL;
+        die("replay");
+    }
+    E.termRows = hdr[4] | hdr[5] << 8;
+    E.termCols = hdr[6] | hdr[7] << 8;
+    L.replay = true;
+    L.recordedUs = 0;
+}
+
+/*
+ * Reads the next key of a replayed recording.
+ * Args:
+ *   key - Pointer to store the key code.
+ * Returns:
+ *   false at the end of the recording.
+ */
+static bool inputLogNextKey(int *key) {
+    uint64_t delta, zz;
+    if (!inputLogGetVarint(&delta) || !inputLogGetVarint(&zz)) return false;
+    L.recordedUs += delta;
+    *key = (int)(zz >> 1) ^ -(int)(zz & 1);
+    return true;
+}
+
 /*** Terminal Functions ***/
 
 /*
@@ -119,9 +800,43 @@ static void disableRawMode(void) {
     }
 }
 
+/*
+ * Asks the terminal whether it supports synchronized output (DEC private
+ * mode 2026). A primary device attributes request follows the mode query;
+ * every terminal answers it, so terminals that ignore the mode query do
+ * not cost a timeout.
+ * Returns:
+ *   true if the terminal reported mode 2026 as set or reset.
+ */
+static bool queryTerminalSyncOutput(void) {
+    const char *query = "\x1b[?2026$p\x1b[c";
+    char buf[64];
+    unsigned int len = 0;
+
+    if (write(STDOUT_FILENO, query, strlen(query)) != (ssize_t)strlen(query)) return false;
+
+    uint64_t deadline = monotonicNs() + TERMINAL_QUERY_TIMEOUT_MS * NSEC_PER_MSEC;
+    while (len < sizeof(buf) - 1) {
+        uint64_t now = monotonicNs();
+        if (now >= deadline) break;
+        struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+        if (poll(&pfd, 1, (deadline - now) / NSEC_PER_MSEC + 1) <= 0) break;
+        if (read(STDIN_FILENO, &buf[len], 1) != 1) break;
+        if (buf[len++] == 'c') break; // End of the device attributes reply
+    }
+    buf[len] = '\0';
+
+    // Reply is "\x1b[?2026;Ps$y"; Ps 1 or 2 means the mode is recognized
+    char *reply = strstr(buf, "\x1b[?2026;");
+    if (reply == NULL) return false;
+    char ps = reply[strlen("\x1b[?2026;")];
+    return ps == '1' || ps == '2';
+}
+
 /*
  * Configures the terminal to raw mode for character-by-character input.
  * Saves original terminal settings and disables canonical mode, echo, and signals.
+ * Also detects whether frames can be wrapped in synchronized updates.
  */
 static void enableRawMode(void) {
     if (tcgetattr(STDIN_FILENO, &E.orig_termios) == -1) {
@@ -136,11 +851,13 @@ static void enableRawMode(void) {
     raw.c_cflag |= (CS8);
     raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
     raw.c_cc[VMIN] = 0;
-    raw.c_cc[VTIME] = 0.1; // 0.1 seconds timeout for read
+    raw.c_cc[VTIME] = 1;   // 0.1 seconds timeout for read
     
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) {
         die("tcsetattr");
     }
+
+    E.syncOutput = queryTerminalSyncOutput();
 }
 
 /*
@@ -169,10 +886,34 @@ static int editorReadKey(void) {
             // Handle sequences like "[3~" (DEL), "[5~" (PAGE_UP), etc.
             if (seq[1] >= '0' && seq[1] <= '9') {
                 if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
-                if (seq[2] == '~') {
+                if (seq[1] == '1' && seq[2] == ';') {
+                    // Modified keys like "[1;5A" (Ctrl-Up) or "[1;2A" (Shift-Up)
+                    char mod[2];
+                    if (read(STDIN_FILENO, mod, 2) != 2) return '\x1b';
+                    if (mod[0] == '5') {
+                        switch (mod[1]) {
+                            case 'A': return CTRL_ARROW_UP;
+                            case 'B': return CTRL_ARROW_DOWN;
+                            case 'C': return CTRL_ARROW_RIGHT;
+                            case 'D': return CTRL_ARROW_LEFT;
+                        }
+                    } else if (mod[0] == '6') {
+                        switch (mod[1]) {
+                            case 'C': return CTRL_SHIFT_ARROW_RIGHT;
+                            case 'D': return CTRL_SHIFT_ARROW_LEFT;
+                        }
+                    } else if (mod[0] == '2') {
+                        switch (mod[1]) {
+                            case 'A': return SHIFT_ARROW_UP;
+                            case 'B': return SHIFT_ARROW_DOWN;
+                            case 'C': return SHIFT_ARROW_RIGHT;
+                            case 'D': return SHIFT_ARROW_LEFT;
+                        }
+                    }
+                } else if (seq[2] == '~') {
                     switch (seq[1]) {
                         case '1': return HOME_KEY;
-                        case '3': return DEL_KEY;   // DEL key; currently does nothing
+                        case '3': return DEL_KEY;
                         case '4': return END_KEY;
                         case '5': return PAGE_UP;
                         case '6': return PAGE_DOWN;
@@ -278,136 +1019,5567 @@ static bool checkVersionFlag(int argc, char *argv[]) {
     return false;
 }
 
-/*** Output functions ***/
-
 /*
- * Draws the editor rows with tildes and a welcome message.
+ * Handles the options that precede the file name:
+ *   --trace <file>   write a Chrome trace of hot-path spans on exit
+ *                    (also enabled by the LEKHANI_TRACE variable)
+ *   --record <file>  record every key read from the terminal
+ *   --replay <file>  replay a recording headlessly and report timings
+ *   --follow         follow appends to the file like tail -f
  * Args:
- *   ab - Pointer to the append buffer to store the output.
+ *   argc - Number of command-line arguments.
+ *   argv - Array of command-line argument strings.
+ * Returns:
+ *   The index of the first argument that is not an option.
  */
-static void editorDrawRows(struct abuf *ab) {
-    for (int y = 0; y < E.screenRows; y++) {
-        if (y == E.screenRows / 3) {
-            char welcome[80];
-            int welcomelen = snprintf(welcome, sizeof(welcome),
-                                     "Lekhani editor -- version %s", VERSION);
-            if (welcomelen > E.screenCols) welcomelen = E.screenCols;
-            int padding = (E.screenCols - welcomelen) / 2;
-            if (padding) {
-                abAppend(ab, "~", 1);
-                padding--;
-            }
-            while (padding--) abAppend(ab, " ", 1);
-            abAppend(ab, welcome, welcomelen);
-        } else {
-            abAppend(ab, "~", 1);
+static int checkOptionFlags(int argc, char *argv[]) {
+    int i = 1;
+    char *env = getenv("LEKHANI_TRACE");
+    if (env && *env) traceEnable(env);
+
+    while (i < argc) {
+        if (strcmp(argv[i], "--follow") == 0) {
+            E.follow = true;
+            i++;
+            continue;
         }
-        abAppend(ab, "\x1b[K", 3); // Clear line from cursor to end
-        if (y < E.screenRows - 1) {
-            abAppend(ab, "\r\n", 2);
+        if (i + 1 >= argc) break;
+        if (strcmp(argv[i], "--trace") == 0) {
+            if (!T.enabled) traceEnable(argv[i + 1]);
+        } else if (strcmp(argv[i], "--record") == 0) {
+            inputLogRecord(argv[i + 1]);
+        } else if (strcmp(argv[i], "--replay") == 0) {
+            inputLogReplay(argv[i + 1]);
+        } else {
+            break;
         }
+        i += 2;
     }
+    return i;
 }
 
+/*** Unicode Functions ***/
+
 /*
- * Refreshes the editor screen by drawing rows and updating cursor position.
+ * Codepoints that occupy no column of their own: combining marks, format
+ * characters and Hangul medial/final jamo. Derived from Unicode 14.0.
  */
-static void editorRefreshScreen(void) {
-    struct abuf ab = ABUF_INIT;
+static const struct widthRange zeroWidthRanges[] = {
+    {0x0300, 0x036F}, {0x0483, 0x0489}, {0x0591, 0x05BD}, {0x05BF, 0x05BF},
+    {0x05C1, 0x05C2}, {0x05C4, 0x05C5}, {0x05C7, 0x05C7}, {0x0600, 0x0605},
+    {0x0610, 0x061A}, {0x061C, 0x061C}, {0x064B, 0x065F}, {0x0670, 0x0670},
+    {0x06D6, 0x06DD}, {0x06DF, 0x06E4}, {0x06E7, 0x06E8}, {0x06EA, 0x06ED},
+    {0x070F, 0x070F}, {0x0711, 0x0711}, {0x0730, 0x074A}, {0x07A6, 0x07B0},
+    {0x07EB, 0x07F3}, {0x07FD, 0x07FD}, {0x0816, 0x0819}, {0x081B, 0x0823},
+    {0x0825, 0x0827}, {0x0829, 0x082D}, {0x0859, 0x085B}, {0x0890, 0x089F},
+    {0x08CA, 0x0902}, {0x093A, 0x093A}, {0x093C, 0x093C}, {0x0941, 0x0948},
+    {0x094D, 0x094D}, {0x0951, 0x0957}, {0x0962, 0x0963}, {0x0981, 0x0981},
+    {0x09BC, 0x09BC}, {0x09C1, 0x09C4}, {0x09CD, 0x09CD}, {0x09E2, 0x09E3},
+    {0x09FE, 0x0A02}, {0x0A3C, 0x0A3C}, {0x0A41, 0x0A51}, {0x0A70, 0x0A71},
+    {0x0A75, 0x0A75}, {0x0A81, 0x0A82}, {0x0ABC, 0x0ABC}, {0x0AC1, 0x0AC8},
+    {0x0ACD, 0x0ACD}, {0x0AE2, 0x0AE3}, {0x0AFA, 0x0B01}, {0x0B3C, 0x0B3C},
+    {0x0B3F, 0x0B3F}, {0x0B41, 0x0B44}, {0x0B4D, 0x0B56}, {0x0B62, 0x0B63},
+    {0x0B82, 0x0B82}, {0x0BC0, 0x0BC0}, {0x0BCD, 0x0BCD}, {0x0C00, 0x0C00},
+    {0x0C04, 0x0C04}, {0x0C3C, 0x0C3C}, {0x0C3E, 0x0C40}, {0x0C46, 0x0C56},
+    {0x0C62, 0x0C63}, {0x0C81, 0x0C81}, {0x0CBC, 0x0CBC}, {0x0CBF, 0x0CBF},
+    {0x0CC6, 0x0CC6}, {0x0CCC, 0x0CCD}, {0x0CE2, 0x0CE3}, {0x0D00, 0x0D01},
+    {0x0D3B, 0x0D3C}, {0x0D41, 0x0D44}, {0x0D4D, 0x0D4D}, {0x0D62, 0x0D63},
+    {0x0D81, 0x0D81}, {0x0DCA, 0x0DCA}, {0x0DD2, 0x0DD6}, {0x0E31, 0x0E31},
+    {0x0E34, 0x0E3A}, {0x0E47, 0x0E4E}, {0x0EB1, 0x0EB1}, {0x0EB4, 0x0EBC},
+    {0x0EC8, 0x0ECD}, {0x0F18, 0x0F19}, {0x0F35, 0x0F35}, {0x0F37, 0x0F37},
+    {0x0F39, 0x0F39}, {0x0F71, 0x0F7E}, {0x0F80, 0x0F84}, {0x0F86, 0x0F87},
+    {0x0F8D, 0x0FBC}, {0x0FC6, 0x0FC6}, {0x102D, 0x1030}, {0x1032, 0x1037},
+    {0x1039, 0x103A}, {0x103D, 0x103E}, {0x1058, 0x1059}, {0x105E, 0x1060},
+    {0x1071, 0x1074}, {0x1082, 0x1082}, {0x1085, 0x1086}, {0x108D, 0x108D},
+    {0x109D, 0x109D}, {0x1160, 0x11FF}, {0x135D, 0x135F}, {0x1712, 0x1714},
+    {0x1732, 0x1733}, {0x1752, 0x1753}, {0x1772, 0x1773}, {0x17B4, 0x17B5},
+    {0x17B7, 0x17BD}, {0x17C6, 0x17C6}, {0x17C9, 0x17D3}, {0x17DD, 0x17DD},
+    {0x180B, 0x180F}, {0x1885, 0x1886}, {0x18A9, 0x18A9}, {0x1920, 0x1922},
+    {0x1927, 0x1928}, {0x1932, 0x1932}, {0x1939, 0x193B}, {0x1A17, 0x1A18},
+    {0x1A1B, 0x1A1B}, {0x1A56, 0x1A56}, {0x1A58, 0x1A60}, {0x1A62, 0x1A62},
+    {0x1A65, 0x1A6C}, {0x1A73, 0x1A7F}, {0x1AB0, 0x1B03}, {0x1B34, 0x1B34},
+    {0x1B36, 0x1B3A}, {0x1B3C, 0x1B3C}, {0x1B42, 0x1B42}, {0x1B6B, 0x1B73},
+    {0x1B80, 0x1B81}, {0x1BA2, 0x1BA5}, {0x1BA8, 0x1BA9}, {0x1BAB, 0x1BAD},
+    {0x1BE6, 0x1BE6}, {0x1BE8, 0x1BE9}, {0x1BED, 0x1BED}, {0x1BEF, 0x1BF1},
+    {0x1C2C, 0x1C33}, {0x1C36, 0x1C37}, {0x1CD0, 0x1CD2}, {0x1CD4, 0x1CE0},
+    {0x1CE2, 0x1CE8}, {0x1CED, 0x1CED}, {0x1CF4, 0x1CF4}, {0x1CF8, 0x1CF9},
+    {0x1DC0, 0x1DFF}, {0x200B, 0x200F}, {0x202A, 0x202E}, {0x2060, 0x206F},
+    {0x20D0, 0x20F0}, {0x2CEF, 0x2CF1}, {0x2D7F, 0x2D7F}, {0x2DE0, 0x2DFF},
+    {0x302A, 0x302D}, {0x3099, 0x309A}, {0xA66F, 0xA672}, {0xA674, 0xA67D},
+    {0xA69E, 0xA69F}, {0xA6F0, 0xA6F1}, {0xA802, 0xA802}, {0xA806, 0xA806},
+    {0xA80B, 0xA80B}, {0xA825, 0xA826}, {0xA82C, 0xA82C}, {0xA8C4, 0xA8C5},
+    {0xA8E0, 0xA8F1}, {0xA8FF, 0xA8FF}, {0xA926, 0xA92D}, {0xA947, 0xA951},
+    {0xA980, 0xA982}, {0xA9B3, 0xA9B3}, {0xA9B6, 0xA9B9}, {0xA9BC, 0xA9BD},
+    {0xA9E5, 0xA9E5}, {0xAA29, 0xAA2E}, {0xAA31, 0xAA32}, {0xAA35, 0xAA36},
+    {0xAA43, 0xAA43}, {0xAA4C, 0xAA4C}, {0xAA7C, 0xAA7C}, {0xAAB0, 0xAAB0},
+    {0xAAB2, 0xAAB4}, {0xAAB7, 0xAAB8}, {0xAABE, 0xAABF}, {0xAAC1, 0xAAC1},
+    {0xAAEC, 0xAAED}, {0xAAF6, 0xAAF6}, {0xABE5, 0xABE5}, {0xABE8, 0xABE8},
+    {0xABED, 0xABED}, {0xFB1E, 0xFB1E}, {0xFE00, 0xFE0F}, {0xFE20, 0xFE2F},
+    {0xFEFF, 0xFEFF}, {0xFFF9, 0xFFFB}, {0x101FD, 0x101FD}, {0x102E0, 0x102E0},
+    {0x10376, 0x1037A}, {0x10A01, 0x10A0F}, {0x10A38, 0x10A3F}, {0x10AE5, 0x10AE6},
+    {0x10D24, 0x10D27}, {0x10EAB, 0x10EAC}, {0x10F46, 0x10F50}, {0x10F82, 0x10F85},
+    {0x11001, 0x11001}, {0x11038, 0x11046}, {0x11070, 0x11070}, {0x11073, 0x11074},
+    {0x1107F, 0x11081}, {0x110B3, 0x110B6}, {0x110B9, 0x110BA}, {0x110BD, 0x110BD},
+    {0x110C2, 0x110CD}, {0x11100, 0x11102}, {0x11127, 0x1112B}, {0x1112D, 0x11134},
+    {0x11173, 0x11173}, {0x11180, 0x11181}, {0x111B6, 0x111BE}, {0x111C9, 0x111CC},
+    {0x111CF, 0x111CF}, {0x1122F, 0x11231}, {0x11234, 0x11234}, {0x11236, 0x11237},
+    {0x1123E, 0x1123E}, {0x112DF, 0x112DF}, {0x112E3, 0x112EA}, {0x11300, 0x11301},
+    {0x1133B, 0x1133C}, {0x11340, 0x11340}, {0x11366, 0x11374}, {0x11438, 0x1143F},
+    {0x11442, 0x11444}, {0x11446, 0x11446}, {0x1145E, 0x1145E}, {0x114B3, 0x114B8},
+    {0x114BA, 0x114BA}, {0x114BF, 0x114C0}, {0x114C2, 0x114C3}, {0x115B2, 0x115B5},
+    {0x115BC, 0x115BD}, {0x115BF, 0x115C0}, {0x115DC, 0x115DD}, {0x11633, 0x1163A},
+    {0x1163D, 0x1163D}, {0x1163F, 0x11640}, {0x116AB, 0x116AB}, {0x116AD, 0x116AD},
+    {0x116B0, 0x116B5}, {0x116B7, 0x116B7}, {0x1171D, 0x1171F}, {0x11722, 0x11725},
+    {0x11727, 0x1172B}, {0x1182F, 0x11837}, {0x11839, 0x1183A}, {0x1193B, 0x1193C},
+    {0x1193E, 0x1193E}, {0x11943, 0x11943}, {0x119D4, 0x119DB}, {0x119E0, 0x119E0},
+    {0x11A01, 0x11A0A}, {0x11A33, 0x11A38}, {0x11A3B, 0x11A3E}, {0x11A47, 0x11A47},
+    {0x11A51, 0x11A56}, {0x11A59, 0x11A5B}, {0x11A8A, 0x11A96}, {0x11A98, 0x11A99},
+    {0x11C30, 0x11C3D}, {0x11C3F, 0x11C3F}, {0x11C92, 0x11CA7}, {0x11CAA, 0x11CB0},
+    {0x11CB2, 0x11CB3}, {0x11CB5, 0x11CB6}, {0x11D31, 0x11D45}, {0x11D47, 0x11D47},
+    {0x11D90, 0x11D91}, {0x11D95, 0x11D95}, {0x11D97, 0x11D97}, {0x11EF3, 0x11EF4},
+    {0x13430, 0x13438}, {0x16AF0, 0x16AF4}, {0x16B30, 0x16B36}, {0x16F4F, 0x16F4F},
+    {0x16F8F, 0x16F92}, {0x16FE4, 0x16FE4}, {0x1BC9D, 0x1BC9E}, {0x1BCA0, 0x1CF46},
+    {0x1D167, 0x1D169}, {0x1D173, 0x1D182}, {0x1D185, 0x1D18B}, {0x1D1AA, 0x1D1AD},
+    {0x1D242, 0x1D244}, {0x1DA00, 0x1DA36}, {0x1DA3B, 0x1DA6C}, {0x1DA75, 0x1DA75},
+    {0x1DA84, 0x1DA84}, {0x1DA9B, 0x1DAAF}, {0x1E000, 0x1E02A}, {0x1E130, 0x1E136},
+    {0x1E2AE, 0x1E2AE}, {0x1E2EC, 0x1E2EF}, {0x1E8D0, 0x1E8D6}, {0x1E944, 0x1E94A},
+    {0xE0001, 0xE01EF},
+};
 
-    abAppend(&ab, "\x1b[?25l", 6); // Hide cursor
-    abAppend(&ab, "\x1b[H", 3);    // Move cursor to top-left
-    editorDrawRows(&ab);
+/*
+ * Codepoints that occupy two columns (East Asian Wide and Fullwidth).
+ */
+static const struct widthRange wideRanges[] = {
+    {0x1100, 0x115F}, {0x231A, 0x231B}, {0x2329, 0x232A}, {0x23E9, 0x23EC},
+    {0x23F0, 0x23F0}, {0x23F3, 0x23F3}, {0x25FD, 0x25FE}, {0x2614, 0x2615},
+    {0x2648, 0x2653}, {0x267F, 0x267F}, {0x2693, 0x2693}, {0x26A1, 0x26A1},
+    {0x26AA, 0x26AB}, {0x26BD, 0x26BE}, {0x26C4, 0x26C5}, {0x26CE, 0x26CE},
+    {0x26D4, 0x26D4}, {0x26EA, 0x26EA}, {0x26F2, 0x26F3}, {0x26F5, 0x26F5},
+    {0x26FA, 0x26FA}, {0x26FD, 0x26FD}, {0x2705, 0x2705}, {0x270A, 0x270B},
+    {0x2728, 0x2728}, {0x274C, 0x274C}, {0x274E, 0x274E}, {0x2753, 0x2755},
+    {0x2757, 0x2757}, {0x2795, 0x2797}, {0x27B0, 0x27B0}, {0x27BF, 0x27BF},
+    {0x2B1B, 0x2B1C}, {0x2B50, 0x2B50}, {0x2B55, 0x2B55}, {0x2E80, 0x303E},
+    {0x3041, 0x3247}, {0x3250, 0x4DBF}, {0x4E00, 0xA4C6}, {0xA960, 0xA97C},
+    {0xAC00, 0xD7A3}, {0xF900, 0xFAD9}, {0xFE10, 0xFE6B}, {0xFF01, 0xFF60},
+    {0xFFE0, 0xFFE6}, {0x16FE0, 0x1B2FB}, {0x1F004, 0x1F004}, {0x1F0CF, 0x1F0CF},
+    {0x1F18E, 0x1F18E}, {0x1F191, 0x1F19A}, {0x1F200, 0x1F320}, {0x1F32D, 0x1F335},
+    {0x1F337, 0x1F37C}, {0x1F37E, 0x1F393}, {0x1F3A0, 0x1F3CA}, {0x1F3CF, 0x1F3D3},
+    {0x1F3E0, 0x1F3F0}, {0x1F3F4, 0x1F3F4}, {0x1F3F8, 0x1F43E}, {0x1F440, 0x1F440},
+    {0x1F442, 0x1F4FC}, {0x1F4FF, 0x1F53D}, {0x1F54B, 0x1F54E}, {0x1F550, 0x1F567},
+    {0x1F57A, 0x1F57A}, {0x1F595, 0x1F596}, {0x1F5A4, 0x1F5A4}, {0x1F5FB, 0x1F64F},
+    {0x1F680, 0x1F6C5}, {0x1F6CC, 0x1F6CC}, {0x1F6D0, 0x1F6D2}, {0x1F6D5, 0x1F6DF},
+    {0x1F6EB, 0x1F6EC}, {0x1F6F4, 0x1F6FC}, {0x1F7E0, 0x1F7F0}, {0x1F90C, 0x1F93A},
+    {0x1F93C, 0x1F945}, {0x1F947, 0x1F9FF}, {0x1FA70, 0x1FAF6}, {0x20000, 0x3FFFD},
+};
 
-    char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", E.cy + 1, E.cx + 1);
-    abAppend(&ab, buf, strlen(buf)); // Move cursor to current position
+/*
+ * Two-level width table built from the ranges above. The first level maps a
+ * block of 256 codepoints to one of the deduplicated second-level blocks,
+ * which hold a 2-bit width per codepoint.
+ */
+#define WIDTH_BLOCK_SHIFT 8
+#define WIDTH_NUM_BLOCKS (0x110000 >> WIDTH_BLOCK_SHIFT)
+#define WIDTH_MAX_BLOCKS 256
+static unsigned char widthStage1[WIDTH_NUM_BLOCKS];
+static unsigned char widthStage2[WIDTH_MAX_BLOCKS][64];
+static int widthNumBlocks;
 
-    abAppend(&ab, "\x1b[?25h", 6); // Show cursor
-    write(STDOUT_FILENO, ab.b, ab.len);
-    abFree(&ab);
-}
+/*
+ * Builds the two-level width table. Must run before any width lookup.
+ */
+static void initCharWidths(void) {
+    size_t nz = sizeof(zeroWidthRanges) / sizeof(zeroWidthRanges[0]);
+    size_t nw = sizeof(wideRanges) / sizeof(wideRanges[0]);
+    size_t zi = 0, wi = 0;
 
-/*** Input Functions ***/
+    widthNumBlocks = 0;
+    for (int b = 0; b < WIDTH_NUM_BLOCKS; b++) {
+        unsigned char block[64] = {0};
+        for (int k = 0; k < 256; k++) {
+            uint32_t cp = ((uint32_t)b << WIDTH_BLOCK_SHIFT) | k;
+            int w = 1;
+            while (zi < nz && zeroWidthRanges[zi].last < cp) zi++;
+            while (wi < nw && wideRanges[wi].last < cp) wi++;
+            if (zi < nz && zeroWidthRanges[zi].first <= cp) w = 0;
+            else if (wi < nw && wideRanges[wi].first <= cp) w = 2;
+            block[k >> 2] |= w << ((k & 3) * 2);
+        }
+
+        int id;
+        for (id = 0; id < widthNumBlocks; id++) {
+            if (memcmp(widthStage2[id], block, sizeof(block)) == 0) break;
+        }
+        if (id == widthNumBlocks) {
+            if (widthNumBlocks == WIDTH_MAX_BLOCKS) die("initCharWidths");
+            memcpy(widthStage2[widthNumBlocks++], block, sizeof(block));
+        }
+        widthStage1[b] = id;
+    }
+}
 
 /*
- * Moves the cursor based on the given key.
+ * Looks up the display width of a codepoint.
  * Args:
- *   key - The key code (e.g., ARROW_LEFT) to process.
+ *   cp - The codepoint.
+ * Returns:
+ *   0 for combining and format characters, 2 for wide characters, 1 otherwise.
  */
-static void editorMoveCursor(int key) {
-    switch (key) {
-        case ARROW_LEFT:
-            if (E.cx > 0) E.cx--;
-            break;
-        case ARROW_RIGHT:
-            if (E.cx < E.screenCols - 1) E.cx++;
-            break;
-        case ARROW_UP:
-            if (E.cy > 0) E.cy--;
-            break;
-        case ARROW_DOWN:
-            if (E.cy < E.screenRows - 1) E.cy++;
-            break;
-    }
+static int charWidth(uint32_t cp) {
+    if (cp >= 0x110000) return 1;
+    const unsigned char *block = widthStage2[widthStage1[cp >> WIDTH_BLOCK_SHIFT]];
+    return (block[(cp & 0xff) >> 2] >> ((cp & 3) * 2)) & 3;
 }
 
 /*
- * Processes a single keypress and updates editor state.
+ * Checks whether a codepoint extends the grapheme cluster before it.
  */
-static void editorProcessKeyPress() {
-    int c = editorReadKey();
+static bool isGraphemeExtend(uint32_t cp) {
+    if (cp >= 0x1F3FB && cp <= 0x1F3FF) return true; // Emoji skin tone modifiers
+    return cp >= 0x80 && charWidth(cp) == 0;
+}
 
-    switch (c) {
-        case CTRL_KEY('q'):
-            write(STDOUT_FILENO, "\x1b[2J", 4);
-            write(STDOUT_FILENO, "\x1b[H", 3);
-            exit(0);
-            break;
-        case HOME_KEY:  // moves cursor to left edge of the screen
-            E.cx = 0;
-            break; 
-        case END_KEY:   // moves cursor to right edge of the screen
-            E.cx = E.screenCols - 1;
-            break; 
-        case PAGE_UP:
-        case PAGE_DOWN:
-            {
-                int times = E.screenRows;
-                while (times--) {
-                    editorMoveCursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
-                }
-            }
-            break;
-        case ARROW_UP:
-        case ARROW_DOWN:
-        case ARROW_LEFT:
-        case ARROW_RIGHT:
-            editorMoveCursor(c);
-            break;
+static bool isRegionalIndicator(uint32_t cp) {
+    return cp >= 0x1F1E6 && cp <= 0x1F1FF;
+}
+
+/*
+ * Decodes one UTF-8 sequence. Invalid, overlong and truncated sequences
+ * decode as a single byte holding U+FFFD.
+ * Args:
+ *   s - The bytes to decode.
+ *   len - Number of bytes available in s.
+ *   i - Offset of the sequence in s.
+ *   cp - Pointer to store the decoded codepoint.
+ * Returns:
+ *   The length of the sequence in bytes.
+ */
+static int utf8Decode(const char *s, int len, int i, uint32_t *cp) {
+    const unsigned char *u = (const unsigned char *)s + i;
+    int avail = len - i;
+    int n;
+    uint32_t c;
+
+    if (u[0] < 0x80) { *cp = u[0]; return 1; }
+    else if (u[0] >= 0xC2 && u[0] <= 0xDF) { n = 2; c = u[0] & 0x1F; }
+    else if (u[0] >= 0xE0 && u[0] <= 0xEF) { n = 3; c = u[0] & 0x0F; }
+    else if (u[0] >= 0xF0 && u[0] <= 0xF4) { n = 4; c = u[0] & 0x07; }
+    else { *cp = 0xFFFD; return 1; }
+
+    if (avail < n) { *cp = 0xFFFD; return 1; }
+    for (int k = 1; k < n; k++) {
+        if ((u[k] & 0xC0) != 0x80) { *cp = 0xFFFD; return 1; }
+        c = (c << 6) | (u[k] & 0x3F);
     }
+    if ((n == 3 && c < 0x800) || (n == 4 && (c < 0x10000 || c > 0x10FFFF)) ||
+        (c >= 0xD800 && c <= 0xDFFF)) {
+        *cp = 0xFFFD;
+        return 1;
+    }
+    *cp = c;
+    return n;
 }
 
-/*** Initialization ***/
+/*
+ * Finds the start of the codepoint that ends at byte offset i.
+ */
+static int utf8PrevStart(const char *s, int i) {
+    int j = i - 1;
+    uint32_t cp;
+    while (j > 0 && i - j < 4 && ((unsigned char)s[j] & 0xC0) == 0x80) j--;
+    if (j + utf8Decode(s, i, j, &cp) != i) return i - 1;
+    return j;
+}
 
 /*
- * Initializes the editor configuration with screen size and cursor position.
+ * Checks whether ASCII_CHUNK bytes are all printable ASCII (0x20-0x7e),
+ * i.e. each byte is exactly one column wide.
  */
-static void initEditor(void) {
-    E.cx = 1;
-    E.cy = 0;
-    if (getWindowSize(&E.screenRows, &E.screenCols) == -1) {
-        die("getWindowSize");
+static bool isPrintableAsciiChunk(const char *s) {
+#if defined(__SSE2__)
+    __m128i v = _mm_loadu_si128((const __m128i *)s);
+    __m128i lo = _mm_cmpgt_epi8(v, _mm_set1_epi8(0x1f));
+    __m128i hi = _mm_cmplt_epi8(v, _mm_set1_epi8(0x7f));
+    return _mm_movemask_epi8(_mm_and_si128(lo, hi)) == 0xffff;
+#else
+    const uint64_t ones = 0x0101010101010101ULL;
+    const uint64_t highs = 0x8080808080808080ULL;
+    for (int k = 0; k < ASCII_CHUNK; k += 8) {
+        uint64_t w, d;
+        memcpy(&w, s + k, 8);
+        if (w & highs) return false;                            // Non-ASCII
+        if ((w - ones * 0x20) & ~w & highs) return false;       // Control
+        d = w ^ (ones * 0x7f);
+        if ((d - ones) & ~d & highs) return false;              // DEL
     }
+    return true;
+#endif
 }
 
-/*** Entry Point ***/
+/*
+ * Checks whether the chunk at offset i can be measured one byte per column.
+ * The byte after the chunk must not be a multibyte sequence, which could be
+ * a combining mark belonging to the chunk's last character.
+ */
+static bool asciiRunAt(const char *s, int len, int i) {
+    if (len - i < ASCII_CHUNK) return false;
+    if (len - i > ASCII_CHUNK && (unsigned char)s[i + ASCII_CHUNK] >= 0x80) return false;
+    return isPrintableAsciiChunk(s + i);
+}
 
 /*
- * Main function: initializes and runs the editor.
+ * Steps over one grapheme cluster, tab or control character.
  * Args:
- *   argc - Number of command-line arguments.
- *   argv - Array of argument strings.
+ *   s - The row bytes.
+ *   len - Length of the row.
+ *   i - Offset of the cluster (must be a cluster boundary).
+ *   rx - Display column where the cluster starts, used for tab stops.
+ *   width - Pointer to store the display width of the cluster.
+ * Returns:
+ *   The offset of the next cluster.
+ */
+static int editorClusterStep(const char *s, int len, int i, int rx, int *width) {
+    unsigned char c = s[i];
+    uint32_t cp, next;
+
+    if (c == '\t') { *width = TAB_STOP - rx % TAB_STOP; return i + 1; }
+    if (c < 0x20 || c == 0x7f) { *width = 2; return i + 1; } // Shown as ^X
+
+    int j = i + utf8Decode(s, len, i, &cp);
+    int w = charWidth(cp);
+    bool ri = isRegionalIndicator(cp);
+    while (j < len) {
+        int n = utf8Decode(s, len, j, &next);
+        if (next == 0x200D) {
+            // A zero width joiner glues the following emoji into the cluster
+            j += n;
+            if (j < len && (unsigned char)s[j] >= 0x80) j += utf8Decode(s, len, j, &next);
+        } else if (ri && isRegionalIndicator(next)) {
+            j += n; // Second half of a flag
+            w = 2;
+        } else if (isGraphemeExtend(next)) {
+            if (next == 0xFE0F) w = 2; // Emoji presentation selector
+            j += n;
+        } else {
+            break;
+        }
+        ri = false;
+    }
+    *width = w;
+    return j;
+}
+
+/*
+ * Finds the start of the grapheme cluster that ends at byte offset i.
+ * Walks back to a codepoint that always starts a cluster, then forward.
+ */
+static int editorPrevCluster(const char *s, int len, int i) {
+    int p = i, prev, w;
+    uint32_t cp, pc;
+
+    while (p > 0) {
+        p = utf8PrevStart(s, p);
+        if ((unsigned char)s[p] < 0x80) break;
+        utf8Decode(s, len, p, &cp);
+        if (isGraphemeExtend(cp) || isRegionalIndicator(cp)) continue;
+        if (p > 0) {
+            utf8Decode(s, len, utf8PrevStart(s, p), &pc);
+            if (pc == 0x200D) continue;
+        }
+        break;
+    }
+    prev = p;
+    while (p < i) {
+        prev = p;
+        p = editorClusterStep(s, len, p, 0, &w);
+    }
+    return prev;
+}
+
+/*
+ * Converts a byte offset within a row to a display column.
+ * Args:
+ *   s - The row bytes.
+ *   len - Length of the row.
+ *   cx - Byte offset within the row.
+ * Returns:
+ *   The display column of cx.
+ */
+static int editorRowCxToRx(const char *s, int len, int cx) {
+    int i = 0, rx = 0, w;
+    if (cx > len) cx = len;
+    while (i < cx) {
+        if (cx - i >= ASCII_CHUNK && asciiRunAt(s, len, i)) {
+            i += ASCII_CHUNK;
+            rx += ASCII_CHUNK;
+            continue;
+        }
+        i = editorClusterStep(s, len, i, rx, &w);
+        rx += w;
+    }
+    return rx;
+}
+
+/*
+ * Converts a display column within a row to the byte offset of the
+ * cluster covering that column.
+ * Args:
+ *   s - The row bytes.
+ *   len - Length of the row.
+ *   rx - Display column.
+ * Returns:
+ *   The byte offset of the cluster at rx, or len if the row is shorter.
+ */
+static int editorRowRxToCx(const char *s, int len, int rx) {
+    int i = 0, cur = 0, w;
+    while (i < len) {
+        if (rx - cur >= ASCII_CHUNK && asciiRunAt(s, len, i)) {
+            i += ASCII_CHUNK;
+            cur += ASCII_CHUNK;
+            continue;
+        }
+        int next = editorClusterStep(s, len, i, cur, &w);
+        if (cur + w > rx) break;
+        cur += w;
+        i = next;
+    }
+    return i;
+}
+
+/*
+ * Expands a row into its on-screen form: tabs become spaces, control
+ * characters become ^X, invalid UTF-8 and C1 controls become U+FFFD.
+ * Args:
+ *   s - The row bytes.
+ *   len - Length of the row.
+ *   out - Append buffer receiving the rendered row.
+ * Returns:
+ *   true if every byte of the rendered row is exactly one column.
+ */
+static bool editorRenderRow(const char *s, int len, struct abuf *out) {
+    int i = 0, rx = 0, w;
+    bool narrow = true;
+    while (i < len) {
+        if (asciiRunAt(s, len, i)) {
+            abAppend(out, &s[i], ASCII_CHUNK);
+            i += ASCII_CHUNK;
+            rx += ASCII_CHUNK;
+            continue;
+        }
+
+        unsigned char c = s[i];
+        int next = editorClusterStep(s, len, i, rx, &w);
+        if (c == '\t') {
+            for (int k = 0; k < w; k++) abAppend(out, " ", 1);
+        } else if (c < 0x20 || c == 0x7f) {
+            char esc[2] = {'^', c ^ 0x40};
+            abAppend(out, esc, 2);
+        } else {
+            uint32_t cp;
+            int n = utf8Decode(s, len, i, &cp);
+            if (c >= 0x80) narrow = false;
+            if ((cp == 0xFFFD && n == 1) || (cp >= 0x80 && cp <= 0x9f)) {
+                abAppend(out, "\xef\xbf\xbd", 3);
+                abAppend(out, &s[i + n], next - i - n);
+            } else {
+                abAppend(out, &s[i], next - i);
+            }
+        }
+        rx += w;
+        i = next;
+    }
+    return narrow;
+}
+
+/*** Render Cache ***/
+
+/*
+ * Empties the render cache and releases the cached renders.
+ */
+static void renderCacheInit(void) {
+    for (int i = 0; i < RC.used; i++) free(RC.entries[i].render);
+    for (int b = 0; b < RENDER_CACHE_BUCKETS; b++) RC.buckets[b] = -1;
+    RC.lruHead = RC.lruTail = -1;
+    RC.freeList = -1;
+    RC.used = 0;
+    RC.bytes = 0;
+}
+
+static int renderCacheBucket(long row) {
+    return (unsigned long)row & (RENDER_CACHE_BUCKETS - 1);
+}
+
+static void renderCacheLruUnlink(int i) {
+    struct renderEntry *e = &RC.entries[i];
+    if (e->lruPrev != -1) RC.entries[e->lruPrev].lruNext = e->lruNext;
+    else RC.lruHead = e->lruNext;
+    if (e->lruNext != -1) RC.entries[e->lruNext].lruPrev = e->lruPrev;
+    else RC.lruTail = e->lruPrev;
+}
+
+static void renderCacheLruPushFront(int i) {
+    struct renderEntry *e = &RC.entries[i];
+    e->lruPrev = -1;
+    e->lruNext = RC.lruHead;
+    if (RC.lruHead != -1) RC.entries[RC.lruHead].lruPrev = i;
+    RC.lruHead = i;
+    if (RC.lruTail == -1) RC.lruTail = i;
+}
+
+/*
+ * Drops an entry from the cache and puts its slot on the free list.
+ */
+static void renderCacheEvict(int i) {
+    struct renderEntry *e = &RC.entries[i];
+    int *link = &RC.buckets[renderCacheBucket(e->row)];
+    while (*link != i) link = &RC.entries[*link].hashNext;
+    *link = e->hashNext;
+    renderCacheLruUnlink(i);
+
+    RC.bytes -= e->rsize;
+    free(e->render);
+    e->render = NULL;
+    e->row = -1;
+    e->hashNext = RC.freeList;
+    RC.freeList = i;
+}
+
+/*
+ * Drops the cached render of a single row, if there is one.
+ */
+static void renderCacheInvalidateRow(long row) {
+    for (int i = RC.buckets[renderCacheBucket(row)]; i != -1; i = RC.entries[i].hashNext) {
+        if (RC.entries[i].row == row) {
+            renderCacheEvict(i);
+            return;
+        }
+    }
+}
+
+/*
+ * Takes a free slot, evicting the least recently used entry if needed.
+ */
+static int renderCacheAlloc(void) {
+    if (RC.freeList == -1) {
+        if (RC.used < RENDER_CACHE_ENTRIES) return RC.used++;
+        renderCacheEvict(RC.lruTail);
+    }
+    int i = RC.freeList;
+    RC.freeList = RC.entries[i].hashNext;
+    return i;
+}
+
+/*** Compressed Files ***/
+
+/*
+ * Hands the rows found so far to the editor and wakes it up.
+ * Args:
+ *   gz - Compressed document.
+ *   found - Start offsets of the rows found since the last call.
+ *   nfound - Number of entries in found.
+ *   indexed - Uncompressed bytes covered by all rows found so far.
+ *   last - The background pass is finishing.
+ * Returns:
+ *   0 on success, -1 if out of memory.
+ */
+static int gzPublish(struct gzDoc *gz, const size_t *found, size_t nfound,
+                     size_t indexed, bool last) {
+    int ret = 0;
+    pthread_mutex_lock(&gz->lock);
+    if (gz->nstarts + nfound > gz->startCap) {
+        size_t cap = gz->startCap ? gz->startCap : 1024;
+        while (cap < gz->nstarts + nfound) cap *= 2;
+        size_t *starts = realloc(gz->starts, cap * sizeof(size_t));
+        if (starts == NULL) {
+            ret = -1;
+            nfound = 0;
+        } else {
+            gz->starts = starts;
+            gz->startCap = cap;
+        }
+    }
+    if (nfound > 0) memcpy(gz->starts + gz->nstarts, found, nfound * sizeof(size_t));
+    gz->nstarts += nfound;
+    if (ret == 0) gz->indexed = indexed;
+    if (last || ret == -1) gz->done = true;
+    pthread_mutex_unlock(&gz->lock);
+
+    // A full pipe already has a wakeup pending
+    if (write(gz->notify[1], "", 1) == -1 && errno != EAGAIN) ret = -1;
+    return ret;
+}
+
+/*
+ * Records a seek checkpoint at a deflate block boundary.
+ * Args:
+ *   gz - Compressed document.
+ *   strm - Inflate stream, stopped at the block boundary.
+ *   out - Uncompressed bytes produced so far.
+ *   window - Circular buffer holding the last GZ_WINDOW bytes of output.
+ *   pos - Next write position in window.
+ * Returns:
+ *   0 on success, -1 if out of memory.
+ */
+static int gzAddPoint(struct gzDoc *gz, const z_stream *strm, size_t out,
+                      const unsigned char *window, size_t pos) {
+    unsigned char *copy = malloc(GZ_WINDOW);
+    if (copy == NULL) return -1;
+    // Unroll the circular buffer so the oldest byte comes first
+    memcpy(copy, window + pos, GZ_WINDOW - pos);
+    memcpy(copy + GZ_WINDOW - pos, window, pos);
+
+    pthread_mutex_lock(&gz->lock);
+    if (gz->npoints == gz->pointCap) {
+        long cap = gz->pointCap ? gz->pointCap * 2 : 64;
+        struct gzPoint *points = realloc(gz->points, cap * sizeof(struct gzPoint));
+        if (points == NULL) {
+            pthread_mutex_unlock(&gz->lock);
+            free(copy);
+            return -1;
+        }
+        gz->points = points;
+        gz->pointCap = cap;
+    }
+    struct gzPoint *pt = &gz->points[gz->npoints++];
+    pt->out = out;
+    pt->in = strm->next_in - gz->src;
+    pt->bits = strm->data_type & 7;
+    pt->window = copy;
+    pthread_mutex_unlock(&gz->lock);
+    return 0;
+}
+
+/*
+ * Background pass over a gzip file: inflates it once, front to back,
+ * recording a checkpoint about every GZ_SPAN bytes of output and the
+ * start of every row. Output goes through a GZ_WINDOW circular buffer,
+ * so memory use does not depend on the size of the file.
+ * Args:
+ *   arg - The compressed document.
+ */
+static void *gzIndexThread(void *arg) {
+    struct gzDoc *gz = arg;
+    unsigned char *window = calloc(1, GZ_WINDOW);
+    size_t found[4096], nfound = 0;
+    size_t out = 0, pos = 0, lineStart = 0, published = 0, lastPoint = 0;
+    bool havePoint = false;
+
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (window == NULL || inflateInit2(&strm, 47) != Z_OK) {
+        free(window);
+        gzPublish(gz, NULL, 0, 0, true);
+        return NULL;
+    }
+    strm.next_in = (Bytef *)gz->src;
+
+    while (!__atomic_load_n(&gz->stop, __ATOMIC_RELAXED)) {
+        size_t left = gz->srcLen - (strm.next_in - gz->src);
+        strm.avail_in = left > UINT_MAX ? UINT_MAX : left;
+        if (pos == GZ_WINDOW) pos = 0;
+        strm.next_out = window + pos;
+        strm.avail_out = GZ_WINDOW - pos;
+        int ret = inflate(&strm, Z_BLOCK);
+
+        unsigned char *p = window + pos, *end = p + (GZ_WINDOW - pos - strm.avail_out);
+        while ((p = memchr(p, '\n', end - p)) != NULL) {
+            if (nfound == sizeof(found) / sizeof(found[0])) {
+                if (gzPublish(gz, found, nfound, lineStart, false) == -1) break;
+                nfound = 0;
+            }
+            found[nfound++] = lineStart;
+            lineStart = out + (++p - (window + pos));
+        }
+        out += end - (window + pos);
+        pos = end - window;
+
+        if (ret == Z_STREAM_END) {
+            // Concatenated members form one file, like gzip -d does
+            if (strm.avail_in == 0 || inflateReset(&strm) != Z_OK) break;
+            continue;
+        }
+        // A truncated or corrupt stream, or padding after the last member,
+        // ends the document where the good data ends
+        if (ret != Z_OK) break;
+        if ((strm.data_type & 128) && !(strm.data_type & 64) &&
+            (!havePoint || out - lastPoint > GZ_SPAN)) {
+            if (gzAddPoint(gz, &strm, out, window, pos) == -1) break;
+            havePoint = true;
+            lastPoint = out;
+        }
+        if (out - published >= GZ_PUBLISH_BYTES) {
+            if (gzPublish(gz, found, nfound, lineStart, false) == -1) break;
+            nfound = 0;
+            published = out;
+        }
+    }
+    inflateEnd(&strm);
+
+    // An unterminated last row ends the document
+    if (lineStart < out) {
+        if (nfound == sizeof(found) / sizeof(found[0])) {
+            gzPublish(gz, found, nfound, lineStart, false);
+            nfound = 0;
+        }
+        found[nfound++] = lineStart;
+    }
+    gzPublish(gz, found, nfound, out, true);
+    free(window);
+    return NULL;
+}
+
+/*
+ * Starts indexing a gzip file in the background.
+ * Args:
+ *   src - Mapped file contents; owned by the returned document.
+ *   srcLen - Length of src.
+ * Returns:
+ *   The compressed document, or NULL on failure.
+ */
+static struct gzDoc *gzOpen(const unsigned char *src, size_t srcLen) {
+    struct gzDoc *gz = calloc(1, sizeof(*gz));
+    if (gz == NULL) return NULL;
+    gz->src = src;
+    gz->srcLen = srcLen;
+    for (int i = 0; i < GZ_CACHE_CHUNKS; i++) gz->cache[i].point = -1;
+    if (pipe2(gz->notify, O_NONBLOCK | O_CLOEXEC) == -1) {
+        free(gz);
+        return NULL;
+    }
+    pthread_mutex_init(&gz->lock, NULL);
+    if (pthread_create(&gz->thread, NULL, gzIndexThread, gz) != 0) {
+        close(gz->notify[0]);
+        close(gz->notify[1]);
+        pthread_mutex_destroy(&gz->lock);
+        free(gz);
+        return NULL;
+    }
+    return gz;
+}
+
+/*
+ * Stops the background pass and frees a compressed document, including
+ * the mapping of its file.
+ * Args:
+ *   gz - Compressed document.
+ */
+static void gzClose(struct gzDoc *gz) {
+    __atomic_store_n(&gz->stop, true, __ATOMIC_RELAXED);
+    pthread_join(gz->thread, NULL);
+    for (long i = 0; i < gz->npoints; i++) free(gz->points[i].window);
+    for (int i = 0; i < GZ_CACHE_CHUNKS; i++) free(gz->cache[i].data);
+    free(gz->points);
+    free(gz->starts);
+    free(gz->scratch);
+    close(gz->notify[0]);
+    close(gz->notify[1]);
+    pthread_mutex_destroy(&gz->lock);
+    munmap((void *)gz->src, gz->srcLen);
+    free(gz);
+}
+
+/*
+ * Inflates uncompressed bytes starting at a checkpoint.
+ * Args:
+ *   gz - Compressed document.
+ *   pt - Checkpoint to resume from.
+ *   buf - Destination buffer.
+ *   len - Bytes wanted.
+ * Returns:
+ *   Bytes produced; fewer than len if the file ends or is corrupt.
+ */
+static size_t gzExtract(const struct gzDoc *gz, const struct gzPoint *pt,
+                        char *buf, size_t len) {
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (inflateInit2(&strm, -15) != Z_OK) return 0;
+    if (pt->bits) inflatePrime(&strm, pt->bits, gz->src[pt->in - 1] >> (8 - pt->bits));
+    inflateSetDictionary(&strm, pt->window, GZ_WINDOW);
+
+    bool raw = true;
+    strm.next_in = (Bytef *)gz->src + pt->in;
+    strm.next_out = (Bytef *)buf;
+    while ((size_t)((char *)strm.next_out - buf) < len) {
+        size_t left = gz->srcLen - (strm.next_in - gz->src);
+        size_t want = len - ((char *)strm.next_out - buf);
+        strm.avail_in = left > UINT_MAX ? UINT_MAX : left;
+        strm.avail_out = want > UINT_MAX ? UINT_MAX : want;
+        int ret = inflate(&strm, Z_NO_FLUSH);
+        if (ret == Z_STREAM_END) {
+            left = gz->srcLen - (strm.next_in - gz->src);
+            if (raw) {
+                // A raw stream leaves the member's trailer for us to skip
+                if (left < 8) break;
+                strm.next_in += 8;
+                left -= 8;
+                raw = false;
+                if (inflateReset2(&strm, 31) != Z_OK) break;
+            } else if (inflateReset(&strm) != Z_OK) {
+                break;
+            }
+            if (left == 0) break;
+        } else if (ret != Z_OK) {
+            break;
+        }
+    }
+    size_t produced = (char *)strm.next_out - buf;
+    inflateEnd(&strm);
+    return produced;
+}
+
+/*
+ * Returns a cached chunk holding an uncompressed offset, inflating it
+ * from the nearest checkpoint at or before the offset on a miss. Only
+ * the span up to the next checkpoint is inflated, never the whole file.
+ * Args:
+ *   gz - Compressed document.
+ *   off - Uncompressed offset, below the indexed length.
+ * Returns:
+ *   The chunk, or NULL if no checkpoint covers the offset yet.
+ */
+static struct gzChunk *gzChunkAt(struct gzDoc *gz, size_t off) {
+    pthread_mutex_lock(&gz->lock);
+    if (gz->npoints == 0) {
+        pthread_mutex_unlock(&gz->lock);
+        return NULL;
+    }
+    long lo = 0, hi = gz->npoints - 1;
+    while (lo < hi) {
+        long mid = (lo + hi + 1) / 2;
+        if (gz->points[mid].out <= off) lo = mid;
+        else hi = mid - 1;
+    }
+    struct gzPoint pt = gz->points[lo];
+    size_t end = lo + 1 < gz->npoints ? gz->points[lo + 1].out : gz->indexed;
+    pthread_mutex_unlock(&gz->lock);
+
+    struct gzChunk *victim = &gz->cache[0];
+    for (int i = 0; i < GZ_CACHE_CHUNKS; i++) {
+        struct gzChunk *c = &gz->cache[i];
+        if (c->point == lo && off < pt.out + c->len) {
+            c->used = ++gz->tick;
+            return c;
+        }
+        if (c->used < victim->used) victim = c;
+    }
+
+    // The last chunk grows while the background pass runs; reinflate it
+    char *data = realloc(victim->data, end > pt.out ? end - pt.out : 1);
+    if (data == NULL) die("realloc");
+    victim->data = data;
+    victim->len = gzExtract(gz, &pt, data, end - pt.out);
+    victim->point = lo;
+    victim->out = pt.out;
+    victim->used = ++gz->tick;
+    if (off >= pt.out + victim->len) return NULL;
+    return victim;
+}
+
+/*
+ * Returns uncompressed bytes of a gzip document as one contiguous run.
+ * Args:
+ *   gz - Compressed document.
+ *   off - Uncompressed offset of the first byte.
+ *   len - Number of bytes, all below the indexed length.
+ * Returns:
+ *   Pointer to the bytes, valid until the next call.
+ */
+static const char *gzBytes(struct gzDoc *gz, size_t off, size_t len) {
+    // Rows near the last one read are almost always in a cached chunk
+    for (int i = 0; i < GZ_CACHE_CHUNKS; i++) {
+        struct gzChunk *c = &gz->cache[i];
+        if (c->point != -1 && off >= c->out && off + len <= c->out + c->len) {
+            c->used = ++gz->tick;
+            return c->data + (off - c->out);
+        }
+    }
+    struct gzChunk *c = gzChunkAt(gz, off);
+    if (c && off + len <= c->out + c->len) return c->data + (off - c->out);
+
+    // The run straddles checkpoints; stitch it together
+    if (len + 1 > gz->scratchCap) {
+        char *scratch = realloc(gz->scratch, len + 1);
+        if (scratch == NULL) die("realloc");
+        gz->scratch = scratch;
+        gz->scratchCap = len + 1;
+    }
+    size_t done = 0;
+    while (done < len) {
+        c = gzChunkAt(gz, off + done);
+        if (c == NULL) break;
+        size_t n = c->out + c->len - (off + done);
+        if (n > len - done) n = len - done;
+        memcpy(gz->scratch + done, c->data + (off + done - c->out), n);
+        done += n;
+    }
+    memset(gz->scratch + done, '\0', len - done);
+    return gz->scratch;
+}
+
+/*** Memory Budget ***/
+
+/*
+ * Sets up the document memory budget from LEKHANI_MEMORY_MB. A quarter
+ * of it goes to the line index, the rest to pages of the mapping.
+ */
+static void budgetInit(void) {
+    long mb = DEFAULT_MEMORY_MB;
+    char *env = getenv("LEKHANI_MEMORY_MB");
+    if (env && atol(env) > 0) mb = atol(env);
+    M.limit = (size_t)mb * 1024 * 1024;
+    M.maxResident = M.limit / 4 * 3 / RESIDENT_GRANULE;
+    if (M.maxResident < 2) M.maxResident = 2;
+    M.resident = malloc(M.maxResident * sizeof(size_t));
+    M.residentUsed = malloc(M.maxResident * sizeof(uint64_t));
+    if (M.resident == NULL || M.residentUsed == NULL) die("malloc");
+    M.nresident = 0;
+    M.indexShift = 0;
+    M.lastGranule = SIZE_MAX;
+    M.scanRow = -1;
+}
+
+/*
+ * Forgets everything known about the previous document.
+ */
+static void budgetReset(void) {
+    M.nresident = 0;
+    M.indexShift = 0;
+    M.lastGranule = SIZE_MAX;
+    M.scanRow = -1;
+}
+
+/*
+ * Drops every page of the mapping that the budget kept resident, for a
+ * document that is about to be parked. The pages are clean, so they are
+ * simply read back from the file if the document is shown again.
+ */
+static void budgetRelease(void) {
+    for (int i = 0; i < M.nresident && E.map; i++) {
+        size_t off = M.resident[i] * RESIDENT_GRANULE;
+        size_t n = E.mapLen - off < RESIDENT_GRANULE ? E.mapLen - off : RESIDENT_GRANULE;
+        madvise(E.map + off, n, MADV_DONTNEED);
+    }
+    budgetReset();
+}
+
+/*
+ * Notes that a range of the mapping is about to be read. Once more
+ * granules have been read than the budget allows, the least recently
+ * read one is dropped with MADV_DONTNEED; the pages are clean, so a
+ * later read faults them back in from the page cache or the file.
+ * Args:
+ *   off - Offset of the first byte.
+ *   len - Number of bytes.
+ */
+static void budgetTouch(size_t off, size_t len) {
+    size_t first = off / RESIDENT_GRANULE;
+    size_t last = (off + (len ? len - 1 : 0)) / RESIDENT_GRANULE;
+    if (first == last && first == M.lastGranule) return;
+
+    for (size_t g = first; g <= last; g++) {
+        int i, lru = 0;
+        for (i = 0; i < M.nresident && M.resident[i] != g; i++) {
+            if (M.residentUsed[i] < M.residentUsed[lru]) lru = i;
+        }
+        if (i == M.nresident) {
+            if (M.nresident < M.maxResident) {
+                M.nresident++;
+            } else {
+                size_t cold = M.resident[lru] * RESIDENT_GRANULE;
+                size_t n = E.mapLen - cold < RESIDENT_GRANULE ? E.mapLen - cold : RESIDENT_GRANULE;
+                madvise(E.map + cold, n, MADV_DONTNEED);
+                i = lru;
+            }
+            M.resident[i] = g;
+        }
+        M.residentUsed[i] = ++M.tick;
+    }
+    M.lastGranule = last;
+}
+
+/*** Piece Table ***/
+
+/*
+ * Creates a piece table over the open file, holding it unmodified.
+ * Returns:
+ *   The new table.
+ */
+static struct pieceTable *pieceNew(void) {
+    struct pieceTable *pt = calloc(1, sizeof(*pt));
+    if (pt == NULL) die("calloc");
+    pt->len = E.mapLen;
+    if (E.mapLen > 0) {
+        pt->pieces = malloc(sizeof(struct piece));
+        if (pt->pieces == NULL) die("malloc");
+        pt->pieces[0] = (struct piece){0, 0, E.mapLen, false};
+        pt->npieces = 1;
+    }
+    return pt;
+}
+
+/*
+ * Frees a piece table.
+ * Args:
+ *   pt - The table.
+ */
+static void pieceFree(struct pieceTable *pt) {
+    free(pt->pieces);
+    free(pt->add);
+    free(pt->scratch);
+    free(pt);
+}
+
+/*
+ * Finds the piece holding a document offset with a binary search.
+ * Args:
+ *   pt - The table.
+ *   off - Offset below pt->len.
+ * Returns:
+ *   Index of the piece.
+ */
+static size_t pieceFind(const struct pieceTable *pt, size_t off) {
+    size_t lo = 0, hi = pt->npieces - 1;
+    while (lo < hi) {
+        size_t mid = (lo + hi + 1) / 2;
+        if (pt->pieces[mid].start <= off) lo = mid;
+        else hi = mid - 1;
+    }
+    return lo;
+}
+
+/*
+ * Returns a pointer to the bytes of one piece, starting some way in.
+ * Bytes of the file are reported to the memory budget.
+ * Args:
+ *   pt - The table.
+ *   p - The piece.
+ *   skip - Bytes of the piece to skip.
+ *   len - Bytes that will be read.
+ */
+static const char *pieceData(const struct pieceTable *pt, const struct piece *p,
+                             size_t skip, size_t len) {
+    if (p->add) return pt->add + p->off + skip;
+    budgetTouch(p->off + skip, len);
+    return E.map + p->off + skip;
+}
+
+/*
+ * Returns how many bytes from an offset lie in the same piece, at most
+ * a given number, so a scan can read them without a copy.
+ * Args:
+ *   pt - The table.
+ *   off - Offset below pt->len.
+ *   len - Bytes wanted.
+ */
+static size_t pieceRun(const struct pieceTable *pt, size_t off, size_t len) {
+    const struct piece *p = &pt->pieces[pieceFind(pt, off)];
+    return p->start + p->len - off < len ? p->start + p->len - off : len;
+}
+
+/*
+ * Returns a contiguous run of document bytes. A run inside one piece is
+ * returned in place; one that spans pieces is copied to the scratch
+ * buffer first.
+ * Args:
+ *   pt - The table.
+ *   off - Offset of the first byte.
+ *   len - Number of bytes, all below pt->len.
+ * Returns:
+ *   Pointer to the bytes, valid until the next call or edit.
+ */
+static const char *pieceBytes(struct pieceTable *pt, size_t off, size_t len) {
+    size_t i = pieceFind(pt, off);
+    const struct piece *p = &pt->pieces[i];
+    if (off + len <= p->start + p->len) return pieceData(pt, p, off - p->start, len);
+
+    if (len > pt->scratchCap) {
+        pt->scratch = realloc(pt->scratch, len);
+        if (pt->scratch == NULL) die("realloc");
+        pt->scratchCap = len;
+    }
+    for (size_t done = 0; done < len; p++) {
+        size_t skip = off + done - p->start;
+        size_t n = p->len - skip < len - done ? p->len - skip : len - done;
+        memcpy(pt->scratch + done, pieceData(pt, p, skip, n), n);
+        done += n;
+    }
+    return pt->scratch;
+}
+
+/*
+ * Appends bytes to the add buffer, from where edits insert them.
+ * Args:
+ *   pt - The table.
+ *   s - The bytes.
+ *   len - Number of bytes.
+ * Returns:
+ *   Offset of the bytes in the add buffer.
+ */
+static size_t pieceAppend(struct pieceTable *pt, const char *s, size_t len) {
+    if (pt->addLen + len > pt->addCap) {
+        size_t cap = pt->addCap ? pt->addCap : 4096;
+        while (cap < pt->addLen + len) cap *= 2;
+        pt->add = realloc(pt->add, cap);
+        if (pt->add == NULL) die("realloc");
+        pt->addCap = cap;
+    }
+    memcpy(pt->add + pt->addLen, s, len);
+    pt->addLen += len;
+    return pt->addLen - len;
+}
+
+/*
+ * Adds a piece to the end of a piece list, extending the last one when
+ * the bytes follow on from it in the same source. Text typed at the same
+ * place over several edits thus stays a single piece.
+ * Args:
+ *   list - The list, with room for one more piece.
+ *   n - Pointer to the number of pieces in the list.
+ *   p - The piece; its start is filled in.
+ */
+static void piecePush(struct piece *list, size_t *n, struct piece p) {
+    if (p.len == 0) return;
+    struct piece *last = *n ? &list[*n - 1] : NULL;
+    if (last && last->add == p.add && last->off + last->len == p.off) {
+        last->len += p.len;
+        return;
+    }
+    p.start = last ? last->start + last->len : 0;
+    list[(*n)++] = p;
+}
+
+/*
+ * Applies a batch of edits in one pass over the pieces: the pieces are
+ * copied to a new list, split where an edit starts or ends, with the
+ * inserted bytes spliced in between. The cost is one pass however many
+ * edits there are.
+ * Args:
+ *   pt - The table.
+ *   edits - Edits sorted by offset, not overlapping, offsets as before
+ *           the batch.
+ *   n - Number of edits.
+ */
+static void pieceApply(struct pieceTable *pt, const struct edit *edits, size_t n) {
+    struct piece *out = malloc((pt->npieces + 2 * n + 1) * sizeof(struct piece));
+    if (out == NULL) die("malloc");
+    size_t nout = 0, i = 0, at = 0;
+
+    for (size_t k = 0; k <= n; k++) {
+        size_t until = k < n ? edits[k].off : pt->len;
+
+        // Keep the bytes from at up to the edit
+        while (at < until) {
+            struct piece p = pt->pieces[i];
+            size_t skip = at - p.start;
+            size_t take = p.len - skip < until - at ? p.len - skip : until - at;
+            piecePush(out, &nout, (struct piece){0, p.off + skip, take, p.add});
+            at += take;
+            if (skip + take == p.len) i++;
+        }
+        if (k == n) break;
+
+        piecePush(out, &nout, (struct piece){0, edits[k].ins, edits[k].insLen, true});
+
+        // Skip the deleted bytes
+        at += edits[k].del;
+        while (i < pt->npieces && pt->pieces[i].start + pt->pieces[i].len <= at) i++;
+    }
+
+    free(pt->pieces);
+    pt->pieces = out;
+    pt->npieces = nout;
+    pt->len = nout ? out[nout - 1].start + out[nout - 1].len : 0;
+}
+
+/*** Line Index Cache ***/
+
+/*
+ * The line index of a large file is kept in LEKHANI_CACHE, by default
+ * $XDG_CACHE_HOME/lekhani or ~/.cache/lekhani, in a file named after the
+ * device and inode. It holds a header and the index entries as they are
+ * in memory, so reopening maps the file instead of scanning the document.
+ */
+
+/*
+ * Frees a line index, or unmaps it if it lives in a cache file.
+ * Args:
+ *   idx - The index.
+ *   mapLen - Length of the cache file mapping, 0 if idx was allocated.
+ */
+static void lineIdxFree(size_t *idx, size_t mapLen) {
+    if (mapLen) munmap((char *)idx - sizeof(struct lineCacheHeader), mapLen);
+    else free(idx);
+}
+
+/*
+ * Empties the line index, keeping its allocation for reuse.
+ */
+static void lineClear(void) {
+    free(E.lineRow);
+    E.lineRow = NULL;
+    E.lineSlots = 0;
+    E.numrows = 0;
+}
+
+/*
+ * Returns the FNV-1a hash of some bytes.
+ */
+static uint64_t lineCacheHash(const char *p, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) h = (h ^ (unsigned char)p[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+/*
+ * Hashes the first and last LINE_CACHE_SAMPLE bytes of a prefix of the
+ * mapped file, which tell a file that only grew from one rewritten.
+ */
+static void lineCacheSample(size_t len, uint64_t *head, uint64_t *tail) {
+    size_t n = len < LINE_CACHE_SAMPLE ? len : LINE_CACHE_SAMPLE;
+    *head = lineCacheHash(E.map, n);
+    *tail = lineCacheHash(E.map + len - n, n);
+}
+
+/*
+ * Builds the path of the cache file for a file, creating the directory
+ * on the way if asked to.
+ * Returns:
+ *   Whether there is a cache directory to use.
+ */
+static bool lineCachePath(const struct stat *st, char *path, size_t cap, bool create) {
+    char dir[PATH_MAX];
+    const char *env = getenv("LEKHANI_CACHE"), *xdg = getenv("XDG_CACHE_HOME"), *home = getenv("HOME");
+    int n;
+    if (env) {
+        if (*env == '\0') return false; // Caching turned off
+        n = snprintf(dir, sizeof(dir), "%s", env);
+    } else if (xdg && *xdg) {
+        n = snprintf(dir, sizeof(dir), "%s/lekhani", xdg);
+    } else if (home && *home) {
+        if (create) {
+            snprintf(dir, sizeof(dir), "%s/.cache", home);
+            mkdir(dir, 0700);
+        }
+        n = snprintf(dir, sizeof(dir), "%s/.cache/lekhani", home);
+    } else {
+        return false;
+    }
+    if (n < 0 || n >= (int)sizeof(dir)) return false;
+    if (create) mkdir(dir, 0700);
+    n = snprintf(path, cap, "%s/%llx-%llx.idx", dir, (unsigned long long)st->st_dev,
+                 (unsigned long long)st->st_ino);
+    return n > 0 && n < (int)cap;
+}
+
+/*
+ * Maps the cached line index of the open file in place of E.lineIdx.
+ * The cache is used when the file is unchanged, or when it only grew:
+ * its first bytes and the bytes that used to be last still hash the same.
+ * The mapping is private, so edits to the index never reach the cache.
+ * Args:
+ *   st - Status of the file.
+ *   from - Pointer to store the length the cache indexed.
+ * Returns:
+ *   Whether the cache was used.
+ */
+static bool lineCacheLoad(const struct stat *st, size_t *from) {
+    char path[PATH_MAX];
+    if ((size_t)st->st_size < LINE_CACHE_MIN_BYTES || !lineCachePath(st, path, sizeof(path), false)) {
+        return false;
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return false;
+    struct stat cst;
+    struct lineCacheHeader *h = MAP_FAILED;
+    if (fstat(fd, &cst) == 0 && (size_t)cst.st_size >= sizeof(*h)) {
+        h = mmap(NULL, cst.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (h == MAP_FAILED) return false;
+
+    uint64_t head, tail;
+    bool ok = memcmp(h->magic, LINE_CACHE_MAGIC, sizeof(h->magic)) == 0 &&
+              h->dev == (uint64_t)st->st_dev && h->ino == (uint64_t)st->st_ino &&
+              h->indexShift < 64 && h->size > 0 && h->size <= (uint64_t)st->st_size &&
+              h->slots == (h->numrows + ((uint64_t)1 << h->indexShift) - 1) >> h->indexShift &&
+              (uint64_t)cst.st_size == sizeof(*h) + h->slots * sizeof(size_t);
+    if (ok && h->size == (uint64_t)st->st_size) {
+        ok = h->mtimeSec == (uint64_t)st->st_mtim.tv_sec && h->mtimeNsec == (uint64_t)st->st_mtim.tv_nsec;
+    }
+    if (ok) {
+        lineCacheSample(h->size, &head, &tail);
+        ok = head == h->headHash && tail == h->tailHash;
+    }
+    if (!ok) {
+        munmap(h, cst.st_size);
+        return false;
+    }
+
+    lineIdxFree(E.lineIdx, E.lineMapLen);
+    lineClear();
+    E.lineIdx = (size_t *)(h + 1);
+    E.lineSlots = E.lineCap = h->slots;
+    E.lineMapLen = cst.st_size;
+    E.numrows = h->numrows;
+    M.indexShift = h->indexShift;
+    *from = h->size;
+    return true;
+}
+
+/*
+ * Writes the line index of the open file to the cache. The file is
+ * written under a temporary name and renamed over the old one, so a
+ * reader never sees it half written. Failures only cost the cache.
+ * Args:
+ *   st - Status of the file.
+ */
+static void lineCacheSave(const struct stat *st) {
+    char path[PATH_MAX], tmp[PATH_MAX + 32];
+    if ((size_t)st->st_size < LINE_CACHE_MIN_BYTES || E.lineRow ||
+        !lineCachePath(st, path, sizeof(path), true)) {
+        return;
+    }
+    snprintf(tmp, sizeof(tmp), "%s.%ld", path, (long)getpid());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1) return;
+
+    struct lineCacheHeader h = {LINE_CACHE_MAGIC, st->st_dev, st->st_ino, st->st_size,
+                                st->st_mtim.tv_sec, st->st_mtim.tv_nsec, 0, 0, E.numrows,
+                                M.indexShift, 0};
+    h.slots = E.lineSlots;
+    lineCacheSample(E.mapLen, &h.headHash, &h.tailHash);
+    const char *parts[2] = {(const char *)&h, (const char *)E.lineIdx};
+    size_t lens[2] = {sizeof(h), h.slots * sizeof(size_t)};
+    bool ok = true;
+    for (int i = 0; i < 2 && ok; i++) {
+        for (size_t done = 0; done < lens[i] && ok;) {
+            ssize_t w = write(fd, parts[i] + done, lens[i] - done);
+            if (w > 0) done += w;
+            else ok = w == -1 && errno == EINTR;
+        }
+    }
+    if (close(fd) == -1 || !ok || rename(tmp, path) == -1) unlink(tmp);
+}
+
+/*** Document Functions ***/
+
+/*
+ * Returns a contiguous run of document bytes.
+ * Args:
+ *   off - Offset of the first byte.
+ *   len - Number of bytes, all below E.docLen.
+ * Returns:
+ *   Pointer to the bytes. For a gzip file or an edited one it stays valid
+ *   only until the next call.
+ */
+static const char *editorDocBytes(size_t off, size_t len) {
+    if (E.pt) return pieceBytes(E.pt, off, len);
+    if (E.gz) return gzBytes(E.gz, off, len);
+    budgetTouch(off, len);
+    return E.map + off;
+}
+
+/*
+ * Finds where the row containing an offset ends.
+ * Args:
+ *   off - Offset within the document.
+ * Returns:
+ *   Offset just past the next newline, or E.docLen if there is none.
+ */
+static size_t editorNextRow(size_t off) {
+    while (off < E.docLen) {
+        size_t n = E.docLen - off < SCAN_CHUNK ? E.docLen - off : SCAN_CHUNK;
+        if (E.pt) n = pieceRun(E.pt, off, n); // Scan piece by piece, without copies
+        const char *p = editorDocBytes(off, n);
+        const char *nl = memchr(p, '\n', n);
+        if (nl) return off + (nl - p) + 1;
+        off += n;
+    }
+    return E.docLen;
+}
+
+/*
+ * Returns the row an entry of the line index is for.
+ */
+static long lineRowOf(size_t slot) {
+    return E.lineRow ? E.lineRow[slot] : (long)slot << M.indexShift;
+}
+
+/*
+ * Returns the last entry of the line index at or before a row.
+ */
+static size_t lineSlotOfRow(long row) {
+    if (E.lineRow == NULL) return (size_t)row >> M.indexShift;
+    size_t lo = 0, hi = E.lineSlots - 1;
+    while (lo < hi) {
+        size_t mid = (lo + hi + 1) / 2;
+        if (E.lineRow[mid] <= row) lo = mid;
+        else hi = mid - 1;
+    }
+    return lo;
+}
+
+/*
+ * Returns the last entry of the line index at or before an offset.
+ */
+static size_t lineSlotOfOffset(size_t off) {
+    size_t lo = 0, hi = E.lineSlots - 1;
+    while (lo < hi) {
+        size_t mid = (lo + hi + 1) / 2;
+        if (E.lineIdx[mid] <= off) lo = mid;
+        else hi = mid - 1;
+    }
+    return lo;
+}
+
+/*
+ * Makes room for entries in the line index, doubling its allocation. A
+ * cached index is copied out of its mapping the first time.
+ * Args:
+ *   n - Entries needed.
+ */
+static void lineReserve(size_t n) {
+    if (n <= E.lineCap) return;
+    size_t cap = E.lineCap ? E.lineCap * 2 : 1024;
+    while (cap < n) cap *= 2;
+    if (E.lineMapLen) {
+        size_t *idx = malloc(cap * sizeof(size_t));
+        if (idx == NULL) die("malloc");
+        memcpy(idx, E.lineIdx, E.lineSlots * sizeof(size_t));
+        lineIdxFree(E.lineIdx, E.lineMapLen);
+        E.lineIdx = idx;
+        E.lineMapLen = 0;
+    } else {
+        size_t *idx = realloc(E.lineIdx, cap * sizeof(size_t));
+        if (idx == NULL) die("realloc");
+        E.lineIdx = idx;
+    }
+    if (E.lineRow) {
+        long *rows = realloc(E.lineRow, cap * sizeof(long));
+        if (rows == NULL) die("realloc");
+        E.lineRow = rows;
+    }
+    E.lineCap = cap;
+}
+
+/*
+ * Starts recording the row of each entry of a sparse line index, once an
+ * edit leaves them off multiples of the stride.
+ */
+static void lineTrackRows(void) {
+    if (E.lineRow) return;
+    E.lineRow = malloc((E.lineCap ? E.lineCap : 1) * sizeof(long));
+    if (E.lineRow == NULL) die("malloc");
+    for (size_t i = 0; i < E.lineSlots; i++) E.lineRow[i] = (long)i << M.indexShift;
+}
+
+/*
+ * Appends a row to the line index. When the index would outgrow its
+ * share of the memory budget it is thinned to every other entry, and
+ * the starts of the rows in between are found by scanning.
+ * Args:
+ *   start - Offset of the row's first byte.
+ */
+static void editorAddRow(size_t start) {
+    long stride = 1L << M.indexShift;
+    if (E.lineSlots == 0 || E.numrows - lineRowOf(E.lineSlots - 1) >= stride) {
+        if (E.lineSlots >= E.lineCap) {
+            size_t cap = E.lineCap ? E.lineCap * 2 : 1024;
+            if (cap * sizeof(size_t) > M.limit / 4 && E.lineSlots > 1) {
+                size_t kept = (E.lineSlots + 1) / 2;
+                for (size_t i = 0; i < kept; i++) {
+                    E.lineIdx[i] = E.lineIdx[2 * i];
+                    if (E.lineRow) E.lineRow[i] = E.lineRow[2 * i];
+                }
+                E.lineSlots = kept;
+                M.indexShift++;
+            } else {
+                lineReserve(E.lineSlots + 1);
+            }
+        }
+        // After thinning the row may fall between the entries kept
+        if (E.lineSlots == 0 || E.numrows - lineRowOf(E.lineSlots - 1) >= 1L << M.indexShift) {
+            E.lineIdx[E.lineSlots] = start;
+            if (E.lineRow) E.lineRow[E.lineSlots] = E.numrows;
+            E.lineSlots++;
+        }
+    }
+    E.numrows++;
+}
+
+/*
+ * Removes the last row from the line index, as when it turns out to
+ * continue into bytes appended to the file.
+ */
+static void editorDropLastRow(void) {
+    renderCacheInvalidateRow(--E.numrows);
+    if (E.lineSlots && lineRowOf(E.lineSlots - 1) >= E.numrows) E.lineSlots--;
+    if (M.scanRow >= E.numrows) M.scanRow = -1;
+}
+
+/*
+ * Returns the offset a row starts at. With a sparse index the nearest
+ * indexed row before it is looked up and the rest is scanned; the last
+ * answer is remembered, so walking rows in order costs one scan each.
+ * Args:
+ *   at - Row index, must be less than E.numrows.
+ */
+static size_t editorRowStart(long at) {
+    if (M.indexShift == 0) return E.lineIdx[at];
+
+    size_t slot = lineSlotOfRow(at);
+    long base = lineRowOf(slot);
+    long row = base;
+    size_t off = E.lineIdx[slot];
+    if (M.scanRow >= base && M.scanRow <= at) {
+        row = M.scanRow;
+        off = M.scanOff;
+    }
+    while (row < at) {
+        off = editorNextRow(off);
+        row++;
+    }
+    M.scanRow = at;
+    M.scanOff = off;
+    return off;
+}
+
+/*
+ * Finds the row containing a byte offset: a binary search over the line
+ * index, then, with a sparse index, a scan of at most one stride.
+ * Args:
+ *   off - Offset within the document; past the end means the last row.
+ * Returns:
+ *   The row index, or 0 for an empty document.
+ */
+static long editorRowAtOffset(size_t off) {
+    if (E.numrows == 0) return 0;
+    if (off >= E.docLen) return E.numrows - 1;
+
+    size_t slot = lineSlotOfOffset(off);
+    long row = lineRowOf(slot);
+    if (M.indexShift == 0) return row;
+
+    size_t start = E.lineIdx[slot];
+    while (row + 1 < E.numrows) {
+        size_t next = editorNextRow(start);
+        if (next > off) break;
+        start = next;
+        row++;
+    }
+    return row;
+}
+
+/*
+ * Asks the kernel to start reading a range of rows from the file
+ * without waiting for it. Only indexed row starts are looked up, so
+ * none of the range is touched here and nothing blocks on the disk.
+ * Args:
+ *   first - First row of the range.
+ *   last - Last row of the range (inclusive).
+ */
+static void editorPrefetchRows(long first, long last) {
+    if (E.map == NULL || E.pt) return; // Edited offsets no longer match the file
+    if (first < 0) first = 0;
+    if (last >= E.numrows) last = E.numrows - 1;
+    if (first > last) return;
+
+    size_t start = E.lineIdx[lineSlotOfRow(first)];
+    size_t next = lineSlotOfRow(last) + 1;
+    size_t end = next < E.lineSlots ? E.lineIdx[next] : E.mapLen;
+    start -= start % sysconf(_SC_PAGESIZE);
+    madvise(E.map + start, end - start, MADV_WILLNEED);
+}
+
+/*
+ * Extends the line index of a mapped file with the rows starting at or
+ * after an offset. The mapping is scanned one granule at a time, so
+ * indexing a file larger than the budget keeps only the tail resident.
+ * Args:
+ *   off - Offset of the first row to add; must start a row.
+ */
+static void editorIndexLines(size_t off) {
+    size_t start = off;
+    while (off < E.mapLen) {
+        size_t end = (off / RESIDENT_GRANULE + 1) * RESIDENT_GRANULE;
+        if (end > E.mapLen) end = E.mapLen;
+        budgetTouch(off, end - off);
+        const char *nl;
+        while ((nl = memchr(E.map + off, '\n', end - off)) != NULL) {
+            editorAddRow(start);
+            start = off = nl - E.map + 1;
+        }
+        off = end;
+    }
+    if (start < E.mapLen) editorAddRow(start);
+}
+
+/*
+ * Takes the rows the background pass over a gzip file has found since
+ * the last call. Rows already taken never change, so the render cache
+ * stays valid. Called when the notify pipe becomes readable.
+ */
+static void editorGzUpdate(void) {
+    char buf[64];
+    while (read(E.gz->notify[0], buf, sizeof(buf)) > 0);
+
+    pthread_mutex_lock(&E.gz->lock);
+    for (size_t i = 0; i < E.gz->nstarts; i++) editorAddRow(E.gz->starts[i]);
+    E.gz->nstarts = 0;
+    E.mapLen = E.docLen = E.gz->indexed;
+    pthread_mutex_unlock(&E.gz->lock);
+    E.dirty = true;
+}
+
+/*
+ * Unmaps the open file and closes it. The line index is kept for reuse.
+ */
+static void editorCloseFile(void) {
+    if (E.gz) gzClose(E.gz);
+    if (E.pt) pieceFree(E.pt);
+    if (E.map) munmap(E.map, E.mapLen);
+    if (E.fd != -1) close(E.fd);
+    E.gz = NULL;
+    E.pt = NULL;
+    E.map = NULL;
+    E.mapLen = E.docLen = 0;
+    E.fd = -1;
+    lineClear();
+    F.n = 0;
+    budgetReset();
+}
+
+/*
+ * Maps a file read-only, replacing the open one, and indexes its lines.
+ * A gzip file is recognised by its magic bytes and indexed in the
+ * background instead; its rows appear as they are found.
+ * Args:
+ *   filename - Path of the file to map.
+ * Returns:
+ *   0 on success, -1 with errno set if the file could not be opened or
+ *   is not a regular file (the open file is kept).
+ */
+static int editorMapFile(const char *filename) {
+    // Non-blocking, so a FIFO is refused below instead of waiting for a writer
+    int fd = open(filename, O_RDONLY | O_NONBLOCK);
+    if (fd == -1) return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        close(fd);
+        errno = S_ISDIR(st.st_mode) ? EISDIR : ENODEV;
+        return -1;
+    }
+    char *map = NULL;
+    if (st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            int err = errno;
+            close(fd);
+            errno = err;
+            return -1;
+        }
+    }
+    const unsigned char *magic = (const unsigned char *)map;
+    if (st.st_size >= 4 && memcmp(magic, "\x28\xb5\x2f\xfd", 4) == 0) {
+        // Zstandard frames cannot be resumed mid-stream without libzstd
+        munmap(map, st.st_size);
+        close(fd);
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    editorCloseFile();
+    E.fd = fd;
+    if (st.st_size >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+        E.gz = gzOpen(magic, st.st_size);
+        if (E.gz == NULL) die("gzOpen");
+    } else {
+        E.map = map;
+        E.mapLen = E.docLen = st.st_size;
+        size_t from = 0;
+        if (lineCacheLoad(&st, &from) && from < E.mapLen && map[from - 1] != '\n') {
+            // An unterminated last row continues into the appended bytes
+            from = editorRowStart(E.numrows - 1);
+            editorDropLastRow();
+        }
+        editorIndexLines(from);
+        if (from < E.mapLen) lineCacheSave(&st);
+    }
+    E.version++;
+    return 0;
+}
+
+/*
+ * Returns the bytes of a document row, without its line terminator.
+ * Args:
+ *   at - Row index, must be less than E.numrows.
+ *   len - Pointer to store the row length.
+ * Returns:
+ *   Pointer to the first byte of the row. For a gzip file it stays valid
+ *   only until the next call.
+ */
+static const char *editorRowAt(long at, int *len) {
+    size_t start = editorRowStart(at);
+    size_t end = at + 1 < E.numrows ? editorRowStart(at + 1) : E.docLen;
+    const char *row = editorDocBytes(start, end - start);
+    if (end > start && row[end - start - 1] == '\n') end--;
+    if (end > start && row[end - start - 1] == '\r') end--;
+    *len = end - start;
+    return row;
+}
+
+/*** Follow Mode ***/
+
+/*
+ * Keeps the cursor inside the document after its content was replaced.
+ */
+static void editorClampCursor(void) {
+    int len = 0;
+    if (E.cy > E.numrows) E.cy = E.numrows;
+    if (E.cy < E.numrows) editorRowAt(E.cy, &len);
+    if (E.cx > len) E.cx = len;
+}
+
+/*
+ * Starts watching the open file for appends, truncation and rotation.
+ * The directory is watched too, so a rotated log is picked up again
+ * once a new file appears under the same name.
+ */
+static void editorFollowWatch(void) {
+    if (E.gz) return; // A compressed file cannot grow in place
+    E.inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (E.inotifyFd == -1) die("inotify_init1");
+    E.fileWatch = inotify_add_watch(E.inotifyFd, E.filename,
+                                    IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF);
+    if (E.fileWatch == -1) die("inotify_add_watch");
+
+    char *slash = strrchr(E.filename, '/');
+    char *dir = slash ? strndup(E.filename, slash == E.filename ? 1 : slash - E.filename)
+                      : strdup(".");
+    if (dir == NULL) die("strdup");
+    E.dirWatch = inotify_add_watch(E.inotifyFd, dir, IN_CREATE | IN_MOVED_TO);
+    free(dir);
+}
+
+/*
+ * Stops watching the file that was followed.
+ */
+static void editorFollowStop(void) {
+    if (E.inotifyFd != -1) close(E.inotifyFd);
+    E.inotifyFd = E.fileWatch = E.dirWatch = -1;
+}
+
+/*
+ * Starts following the open file from its last row.
+ */
+static void editorFollowStart(void) {
+    editorFollowWatch();
+    E.cy = E.numrows > 0 ? E.numrows - 1 : 0;
+    E.cx = 0;
+}
+
+/*
+ * Maps the bytes appended to the file since the last check and indexes
+ * only the rows they add. The mapping is grown with mremap, so pages that
+ * are already mapped stay in place. When the cursor was on the last row
+ * it moves to the new last row, which scrolls the view.
+ * Returns:
+ *   true if the document changed.
+ */
+static bool editorFollowGrow(void) {
+    struct stat st;
+    if (fstat(E.fd, &st) == -1) return false;
+    size_t size = st.st_size;
+    if (size == E.mapLen) return false;
+
+    bool atEnd = E.cy + 1 >= E.numrows;
+    if (size < E.mapLen) {
+        // Truncated in place; start over from the new content
+        char *name = strdup(E.filename);
+        if (name == NULL || editorMapFile(name) == -1) die("open");
+        free(name);
+    } else {
+        char *map = E.map ? mremap(E.map, E.mapLen, size, MREMAP_MAYMOVE)
+                          : mmap(NULL, size, PROT_READ, MAP_PRIVATE, E.fd, 0);
+        if (map == MAP_FAILED) die("mremap");
+
+        // An unterminated last row continues into the appended bytes
+        size_t from = E.mapLen;
+        E.map = map;
+        if (E.numrows > 0 && map[E.mapLen - 1] != '\n') {
+            from = editorRowStart(E.numrows - 1);
+            editorDropLastRow();
+        }
+        E.mapLen = E.docLen = size;
+        editorIndexLines(from);
+    }
+
+    if (atEnd) {
+        E.cy = E.numrows > 0 ? E.numrows - 1 : 0;
+        E.cx = 0;
+    }
+    editorClampCursor();
+    return true;
+}
+
+/*
+ * Reopens the followed file by name after it was rotated away. The old
+ * content stays on screen if no new file exists yet.
+ */
+static void editorFollowReopen(void) {
+    char *name = strdup(E.filename);
+    if (name == NULL) die("strdup");
+    if (editorMapFile(name) == 0) {
+        if (E.fileWatch != -1) inotify_rm_watch(E.inotifyFd, E.fileWatch);
+        E.fileWatch = inotify_add_watch(E.inotifyFd, name,
+                                        IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF);
+        E.cy = E.numrows > 0 ? E.numrows - 1 : 0;
+        E.cx = 0;
+        editorClampCursor();
+    }
+    free(name);
+}
+
+/*
+ * Drains pending inotify events and brings the document up to date.
+ * Any number of queued events costs a single fstat and index extension.
+ */
+static void editorFollowEvents(void) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const char *slash = strrchr(E.filename, '/');
+    const char *base = slash ? slash + 1 : E.filename;
+    bool modified = false, reopen = false;
+    ssize_t n;
+
+    while ((n = read(E.inotifyFd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + n;) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            if (ev->wd == E.fileWatch) {
+                if (ev->mask & IN_MODIFY) modified = true;
+                if (ev->mask & (IN_MOVE_SELF | IN_DELETE_SELF)) modified = true;
+                if (ev->mask & IN_IGNORED) E.fileWatch = -1;
+            } else if (ev->wd == E.dirWatch && ev->len > 0 && strcmp(ev->name, base) == 0) {
+                reopen = true;
+            }
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+
+    // Read what was appended to the old file before switching to the new one
+    if (modified && editorFollowGrow()) E.dirty = true;
+    if (reopen) {
+        editorFollowReopen();
+        E.dirty = true;
+    }
+}
+
+/*** Table Mode ***/
+
+/*
+ * Returns the delimiter implied by a file's extension.
+ * Args:
+ *   path - Path of the file.
+ * Returns:
+ *   Tab for .tsv and .tab, a comma for .csv, 0 for anything else.
+ */
+static char tableExtension(const char *path) {
+    const char *dot = path ? strrchr(path, '.') : NULL;
+    if (dot == NULL) return 0;
+    if (!strcasecmp(dot, ".tsv") || !strcasecmp(dot, ".tab")) return '\t';
+    if (!strcasecmp(dot, ".csv")) return ',';
+    return 0;
+}
+
+/*
+ * Records the end of a field found while splitting a row.
+ */
+static void tableFieldEnd(int *n, int end) {
+    if (*n == G.endsCap) {
+        G.endsCap = G.endsCap ? G.endsCap * 2 : 64;
+        G.ends = realloc(G.ends, G.endsCap * sizeof(int));
+        if (G.ends == NULL) die("realloc");
+    }
+    G.ends[(*n)++] = end;
+}
+
+/*
+ * Splits a row into fields at the delimiter, skipping delimiters inside
+ * double quotes. The delimiter and quote bytes are found ASCII_CHUNK at a
+ * time, so a row costs a compare per chunk plus one step per hit. A
+ * quoted field running past the end of its line is cut there.
+ * Args:
+ *   s - The row bytes.
+ *   len - Length of the row.
+ * Returns:
+ *   The number of fields; G.ends holds the offset just past each one,
+ *   which is where its delimiter is.
+ */
+static int tableSplit(const char *s, int len) {
+    int n = 0, i = 0;
+    bool quoted = false;
+#if defined(__SSE2__)
+    __m128i delim = _mm_set1_epi8(G.delim), quote = _mm_set1_epi8('"');
+    for (; i + ASCII_CHUNK <= len && n < TABLE_MAX_COLUMNS - 1; i += ASCII_CHUNK) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        unsigned mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, delim),
+                                                       _mm_cmpeq_epi8(v, quote)));
+        while (mask && n < TABLE_MAX_COLUMNS - 1) {
+            int k = i + __builtin_ctz(mask);
+            mask &= mask - 1;
+            if (s[k] == '"') quoted = !quoted;
+            else if (!quoted) tableFieldEnd(&n, k);
+        }
+    }
+#endif
+    for (; i < len && n < TABLE_MAX_COLUMNS - 1; i++) {
+        if (s[i] == '"') quoted = !quoted;
+        else if (s[i] == G.delim && !quoted) tableFieldEnd(&n, i);
+    }
+    tableFieldEnd(&n, len);
+    return n;
+}
+
+/*
+ * Returns the display width of a field, at most TABLE_MAX_WIDTH.
+ */
+static int tableNaturalWidth(const char *s, int len) {
+    int w = editorRowCxToRx(s, len, len);
+    return w < TABLE_MAX_WIDTH ? w : TABLE_MAX_WIDTH;
+}
+
+/*
+ * Returns the width a column is drawn at. Columns no sampled row
+ * reached take the width of the field itself.
+ * Args:
+ *   k - Column index.
+ *   s - The field bytes.
+ *   len - Length of the field.
+ */
+static int tableColumnWidth(int k, const char *s, int len) {
+    return k < G.ncols ? G.widths[k] : tableNaturalWidth(s, len);
+}
+
+/*
+ * Widens the columns to fit the fields of a row.
+ * Args:
+ *   s - The row bytes.
+ *   len - Length of the row.
+ * Returns:
+ *   true if any column got wider.
+ */
+static bool tableFitRow(const char *s, int len) {
+    int n = tableSplit(s, len), start = 0;
+    bool grew = false;
+    if (n > G.colCap) {
+        G.colCap = n * 2;
+        G.widths = realloc(G.widths, G.colCap * sizeof(int));
+        if (G.widths == NULL) die("realloc");
+    }
+    for (; G.ncols < n; G.ncols++) G.widths[G.ncols] = 0;
+    for (int k = 0; k < n; k++) {
+        int w = tableNaturalWidth(s + start, G.ends[k] - start);
+        if (w > G.widths[k]) {
+            G.widths[k] = w;
+            grew = true;
+        }
+        start = G.ends[k] + 1;
+    }
+    return grew;
+}
+
+/*
+ * Picks the delimiter: the one the extension implies, otherwise whichever
+ * of comma, tab, semicolon and bar occurs most outside quotes in the
+ * first rows. A comma is assumed when none occurs.
+ */
+static char tableDetect(void) {
+    static const char candidates[] = ",\t;|";
+    long counts[sizeof(candidates) - 1] = {0};
+    char ext = tableExtension(E.filename);
+    if (ext) return ext;
+
+    for (long r = 0; r < E.numrows && r < TABLE_SAMPLE_ROWS; r++) {
+        int len;
+        const char *row = editorRowAt(r, &len);
+        bool quoted = false;
+        for (int i = 0; i < len; i++) {
+            if (row[i] == '"') quoted = !quoted;
+            if (quoted) continue;
+            const char *c = memchr(candidates, row[i], sizeof(candidates) - 1);
+            if (c) counts[c - candidates]++;
+        }
+    }
+    int best = 0;
+    for (int k = 1; k < (int)sizeof(candidates) - 1; k++) {
+        if (counts[k] > counts[best]) best = k;
+    }
+    return candidates[best];
+}
+
+/*
+ * Sizes the columns from a sample rather than the whole file: the first
+ * TABLE_SAMPLE_ROWS rows and as many spread evenly over the rest, each
+ * found through the line index. A compressed file is sampled at its head
+ * only, since reaching further rows means inflating up to them. Columns
+ * widen later as wider rows come into view.
+ */
+static void tableSample(void) {
+    G.ncols = 0;
+    for (long r = 0; r < E.numrows && r < TABLE_SAMPLE_ROWS; r++) {
+        int len;
+        const char *row = editorRowAt(r, &len);
+        tableFitRow(row, len);
+    }
+    if (E.gz || E.numrows <= TABLE_SAMPLE_ROWS) return;
+    for (long k = 1; k <= TABLE_SAMPLE_ROWS; k++) {
+        int len;
+        const char *row = editorRowAt((E.numrows - 1) / TABLE_SAMPLE_ROWS * k, &len);
+        tableFitRow(row, len);
+    }
+}
+
+/*
+ * Turns table mode on or off for the shown document.
+ * Args:
+ *   on - Whether rows are drawn as aligned fields.
+ */
+static void tableStart(bool on) {
+    G.on = on;
+    if (on) {
+        G.delim = tableDetect();
+        tableSample();
+    }
+    renderCacheInit(); // Cached renders were laid out the other way
+}
+
+/*
+ * Widens the columns to fit every row on screen, in any pane.
+ * Returns:
+ *   true if the layout changed, which drops the cached renders.
+ */
+static bool tableFitView(void) {
+    bool grew = false;
+    for (int i = 0; i < V.npanes; i++) {
+        long rowoff = i == V.active ? E.rowoff : V.panes[i].rowoff;
+        int rows = i == V.active ? E.screenRows : V.panes[i].rows;
+        for (long r = rowoff; r < rowoff + rows && r < E.numrows; r++) {
+            int len;
+            const char *row = editorRowAt(r, &len);
+            if (tableFitRow(row, len)) grew = true;
+        }
+    }
+    if (grew) renderCacheInit();
+    return grew;
+}
+
+/*
+ * Renders a row as its fields, each rendered like a row of its own, cut
+ * or padded to its column's width and separated by TABLE_SEPARATOR.
+ * Args:
+ *   s - The row bytes.
+ *   len - Length of the row.
+ *   out - Append buffer receiving the rendered row.
+ * Returns:
+ *   true if every byte of the rendered row is exactly one column.
+ */
+static bool tableRenderRow(const char *s, int len, struct abuf *out) {
+    int n = tableSplit(s, len), start = 0;
+    bool narrow = true;
+    for (int k = 0; k < n; k++) {
+        int flen = G.ends[k] - start, w = tableColumnWidth(k, s + start, flen);
+        int mark = out->len;
+        if (!editorRenderRow(s + start, flen, out)) narrow = false;
+        out->len = mark + editorRowRxToCx(out->b + mark, out->len - mark, w);
+        for (int used = editorRowCxToRx(out->b + mark, out->len - mark, out->len - mark);
+             used < w && k + 1 < n; used++) {
+            abAppend(out, " ", 1);
+        }
+        if (k + 1 < n) abAppend(out, TABLE_SEPARATOR, TABLE_GAP);
+        start = G.ends[k] + 1;
+    }
+    return narrow;
+}
+
+/*
+ * Converts a byte offset within a row to its display column in table
+ * mode. An offset in the cut-off part of a field shows at its end.
+ * Args:
+ *   s - The row bytes.
+ *   len - Length of the row.
+ *   cx - Byte offset within the row.
+ */
+static int tableCxToRx(const char *s, int len, int cx) {
+    int n = tableSplit(s, len), start = 0, col = 0;
+    for (int k = 0; k < n; k++) {
+        int flen = G.ends[k] - start, w = tableColumnWidth(k, s + start, flen);
+        if (cx <= G.ends[k] || k + 1 == n) {
+            int rx = editorRowCxToRx(s + start, flen, cx - start);
+            return col + (rx < w ? rx : w);
+        }
+        col += w + TABLE_GAP;
+        start = G.ends[k] + 1;
+    }
+    return col;
+}
+
+/*
+ * Converts a display column to a byte offset within a row in table
+ * mode. Padding and separators map to the end of the field before them.
+ * Args:
+ *   s - The row bytes.
+ *   len - Length of the row.
+ *   rx - Display column.
+ */
+static int tableRxToCx(const char *s, int len, int rx) {
+    int n = tableSplit(s, len), start = 0, col = 0;
+    for (int k = 0; k < n; k++) {
+        int flen = G.ends[k] - start, w = tableColumnWidth(k, s + start, flen);
+        if (rx < col + w + TABLE_GAP || k + 1 == n) {
+            int x = rx - col < w ? rx - col : w;
+            return start + editorRowRxToCx(s + start, flen, x);
+        }
+        col += w + TABLE_GAP;
+        start = G.ends[k] + 1;
+    }
+    return len;
+}
+
+/*
+ * Converts a byte offset within a row to the display column it is
+ * drawn at, in table mode or not.
+ */
+static int editorCxToRx(const char *s, int len, int cx) {
+    return G.on ? tableCxToRx(s, len, cx) : editorRowCxToRx(s, len, cx);
+}
+
+/*
+ * Converts a display column to the byte offset drawn there, in table
+ * mode or not.
+ */
+static int editorRxToCx(const char *s, int len, int rx) {
+    return G.on ? tableRxToCx(s, len, rx) : editorRowRxToCx(s, len, rx);
+}
+
+/*** Folding ***/
+
+/*
+ * Recomputes the hidden row counts from a fold on, merging folds that
+ * came to overlap and dropping those left with nothing to hide.
+ * Args:
+ *   from - First fold whose count may be out of date.
+ */
+static void foldRecount(size_t from) {
+    size_t n = from;
+    for (size_t k = from; k < F.n; k++) {
+        struct fold f = F.folds[k];
+        if (f.last >= E.numrows) f.last = E.numrows - 1;
+        if (n > 0 && f.first <= F.folds[n - 1].last) {
+            if (f.last > F.folds[n - 1].last) F.folds[n - 1].last = f.last;
+            continue;
+        }
+        if (f.last > f.first) F.folds[n++] = f;
+    }
+    F.n = n;
+    if (F.hidden == NULL) return;
+    from = from > F.n ? F.n : from;
+    from = from ? from - 1 : 0; // The fold before may have absorbed others
+    if (from == 0) F.hidden[0] = 0;
+    for (size_t k = from; k < F.n; k++) {
+        F.hidden[k + 1] = F.hidden[k] + F.folds[k].last - F.folds[k].first;
+    }
+}
+
+/*
+ * Returns the number of folds shown at rows before a row.
+ */
+static size_t foldBefore(long row) {
+    size_t lo = 0, hi = F.n;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (F.folds[mid].first < row) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/*
+ * Returns the fold hiding a row, or -1 if the row is shown.
+ */
+static long foldHiding(long row) {
+    size_t k = foldBefore(row);
+    return k > 0 && F.folds[k - 1].last >= row ? (long)k - 1 : -1;
+}
+
+/*
+ * Converts a document row to the screen row it is drawn at, counting
+ * from the top of the document. A hidden row is drawn with its fold.
+ */
+static long foldRowToVisual(long row) {
+    if (F.n == 0) return row;
+    size_t k = foldBefore(row);
+    if (k > 0 && F.folds[k - 1].last >= row) return F.folds[k - 1].first - F.hidden[k - 1];
+    return row - F.hidden[k];
+}
+
+/*
+ * Converts a screen row, counting from the top of the document, to the
+ * document row drawn there.
+ */
+static long foldVisualToRow(long v) {
+    if (F.n == 0) return v;
+    size_t lo = 0, hi = F.n; // Folds shown above v
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (F.folds[mid].first - F.hidden[mid] < v) lo = mid + 1;
+        else hi = mid;
+    }
+    return v + F.hidden[lo];
+}
+
+/*
+ * Returns the document row drawn a number of screen rows below another.
+ */
+static long foldRowBelow(long row, long n) {
+    return F.n ? foldVisualToRow(foldRowToVisual(row) + n) : row + n;
+}
+
+/*
+ * Hides rows behind the first of them. Folds inside the range are
+ * absorbed, and one reaching past its end extends it.
+ * Args:
+ *   first - Row that stays shown.
+ *   last - Last row hidden.
+ */
+static void foldAdd(long first, long last) {
+    if (last >= E.numrows) last = E.numrows - 1;
+    if (last <= first || foldHiding(first) != -1) return;
+    size_t k = foldBefore(first), end = k;
+    while (end < F.n && F.folds[end].first <= last) {
+        if (F.folds[end].last > last) last = F.folds[end].last;
+        end++;
+    }
+    if (F.n == F.cap) {
+        F.cap = F.cap ? F.cap * 2 : 16;
+        F.folds = realloc(F.folds, F.cap * sizeof(struct fold));
+        F.hidden = realloc(F.hidden, (F.cap + 1) * sizeof(long)); // One past the last fold too
+        if (F.folds == NULL || F.hidden == NULL) die("realloc");
+    }
+    memmove(&F.folds[k + 1], &F.folds[end], (F.n - end) * sizeof(struct fold));
+    F.folds[k] = (struct fold){first, last, 0, 0};
+    F.n = F.n + 1 - (end - k);
+    foldRecount(k);
+}
+
+/*
+ * Shows the rows of a fold again.
+ * Args:
+ *   k - Index of the fold.
+ */
+static void foldRemove(size_t k) {
+    memmove(&F.folds[k], &F.folds[k + 1], (F.n - k - 1) * sizeof(struct fold));
+    F.n--;
+    foldRecount(k);
+}
+
+/*
+ * Notes where the folded rows start before an edit batch changes the
+ * line index.
+ */
+static void foldSaveOffsets(void) {
+    for (size_t k = 0; k < F.n; k++) {
+        F.folds[k].firstOff = editorRowStart(F.folds[k].first);
+        F.folds[k].lastOff = editorRowStart(F.folds[k].last);
+    }
+}
+
+/*
+ * Moves the folds along with an edit batch: each noted row start is
+ * shifted by the edits before it, in one pass over both sorted lists,
+ * and looked up in the new line index.
+ * Args:
+ *   edits - The batch, sorted, offsets as before it.
+ *   n - Number of edits.
+ */
+static void foldApplyEdits(const struct edit *edits, size_t n) {
+    size_t e = 0, delta = 0; // delta wraps when the document shrank
+    for (size_t k = 0; k < F.n; k++) {
+        size_t *offs[2] = {&F.folds[k].firstOff, &F.folds[k].lastOff};
+        for (int i = 0; i < 2; i++) {
+            size_t off = *offs[i];
+            while (e < n && edits[e].off + edits[e].del <= off && edits[e].off < off) {
+                delta += edits[e].insLen - edits[e].del;
+                e++;
+            }
+            // A row start deleted by an edit moves to the end of its text
+            if (e < n && edits[e].off < off) *offs[i] = edits[e].off + delta + edits[e].insLen;
+            else *offs[i] = off + delta;
+        }
+        F.folds[k].first = editorRowAtOffset(F.folds[k].firstOff);
+        F.folds[k].last = editorRowAtOffset(F.folds[k].lastOff);
+    }
+    foldRecount(0);
+}
+
+/*** Bracket Matching ***/
+
+/*
+ * Returns the kind of a bracket byte: 0 for parentheses, 1 for square
+ * brackets, 2 for braces, or -1 for any other byte.
+ */
+static int bracketKind(char c) {
+    switch (c) {
+        case '(': case ')': return 0;
+        case '[': case ']': return 1;
+        case '{': case '}': return 2;
+        default: return -1;
+    }
+}
+
+#if defined(__SSE2__)
+/*
+ * Returns a mask of the bracket bytes among 16, one bit per byte.
+ */
+static unsigned bracketMask(const char *p) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    __m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('(')),
+                             _mm_cmpeq_epi8(v, _mm_set1_epi8(')')));
+    m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('[')),
+                                     _mm_cmpeq_epi8(v, _mm_set1_epi8(']'))));
+    m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('{')),
+                                     _mm_cmpeq_epi8(v, _mm_set1_epi8('}'))));
+    return (unsigned)_mm_movemask_epi8(m);
+}
+#endif
+
+/*
+ * Finds the next bracket byte in a buffer.
+ * Args:
+ *   p - The bytes.
+ *   i - Index to start at.
+ *   n - Number of bytes.
+ * Returns:
+ *   Index of the bracket, or n if there is none.
+ */
+static size_t bracketNext(const char *p, size_t i, size_t n) {
+#if defined(__SSE2__)
+    for (; i + 16 <= n; i += 16) {
+        unsigned m = bracketMask(p + i);
+        if (m) return i + __builtin_ctz(m);
+    }
+#endif
+    while (i < n && bracketKind(p[i]) == -1) i++;
+    return i;
+}
+
+/*
+ * Finds the last bracket byte before an index in a buffer.
+ * Returns:
+ *   Index of the bracket plus one, or 0 if there is none.
+ */
+static size_t bracketPrev(const char *p, size_t i) {
+#if defined(__SSE2__)
+    for (; i >= 16; i -= 16) {
+        unsigned m = bracketMask(p + i - 16);
+        if (m) return i - 16 + 32 - __builtin_clz(m);
+    }
+#endif
+    while (i > 0 && bracketKind(p[i - 1]) == -1) i--;
+    return i;
+}
+
+/*
+ * Returns the bytes of the document from an offset on that one scan step
+ * reads: up to SCAN_CHUNK, within one piece of an edited document.
+ */
+static size_t bracketRun(size_t off, size_t end) {
+    size_t n = end - off < SCAN_CHUNK ? end - off : SCAN_CHUNK;
+    return E.pt ? pieceRun(E.pt, off, n) : n;
+}
+
+/*
+ * Summarizes the brackets of one leaf: for each kind, how far the
+ * nesting depth moves across it and how low it dips on the way.
+ * Args:
+ *   leaf - Index of the leaf in K.nodes.
+ *   start - Document offset the leaf starts at.
+ */
+static void bracketSummarize(size_t leaf, size_t start) {
+    struct bracketNode *b = &K.nodes[leaf];
+    size_t end = start + b->len;
+    memset(b->delta, 0, sizeof(b->delta));
+    memset(b->minPrefix, 0, sizeof(b->minPrefix));
+    for (size_t off = start; off < end;) {
+        size_t n = bracketRun(off, end);
+        const char *p = editorDocBytes(off, n);
+        for (size_t i = bracketNext(p, 0, n); i < n; i = bracketNext(p, i + 1, n)) {
+            int k = bracketKind(p[i]);
+            bool open = p[i] == '(' || p[i] == '[' || p[i] == '{';
+            b->delta[k] += open ? 1 : -1;
+            if (b->delta[k] < b->minPrefix[k]) b->minPrefix[k] = b->delta[k];
+        }
+        off += n;
+    }
+}
+
+/*
+ * Recomputes an inner node of the bracket tree from its two children.
+ * The lowest depth across both is the lower of the left child's and the
+ * right child's offset by the left child's delta.
+ */
+static void bracketPull(size_t x) {
+    const struct bracketNode *l = &K.nodes[2 * x], *r = &K.nodes[2 * x + 1];
+    struct bracketNode *b = &K.nodes[x];
+    b->len = l->len + r->len;
+    for (int k = 0; k < 3; k++) {
+        b->delta[k] = l->delta[k] + r->delta[k];
+        int32_t right = l->delta[k] + r->minPrefix[k];
+        b->minPrefix[k] = l->minPrefix[k] < right ? l->minPrefix[k] : right;
+    }
+}
+
+/*
+ * Returns the highest depth a node reaches counting back from its end,
+ * which is where the lowest one from its start leaves off.
+ */
+static int32_t bracketMaxSuffix(const struct bracketNode *b, int k) {
+    return b->delta[k] - b->minPrefix[k];
+}
+
+/*
+ * Returns the document offset a leaf starts at: the lengths of the
+ * left siblings on its way to the root.
+ */
+static size_t bracketLeafStart(size_t leaf) {
+    size_t off = 0;
+    for (size_t x = leaf; x > 1; x /= 2) {
+        if (x & 1) off += K.nodes[x - 1].len;
+    }
+    return off;
+}
+
+/*
+ * Finds the leaf holding a document offset.
+ * Args:
+ *   off - The offset.
+ *   atEnd - Whether an offset at the end of a leaf counts as in it, as it
+ *           does for an insertion there.
+ *   start - Pointer to store where the leaf starts.
+ * Returns:
+ *   Index of the leaf in K.nodes.
+ */
+static size_t bracketLocate(size_t off, bool atEnd, size_t *start) {
+    size_t x = 1;
+    *start = 0;
+    while (x < K.size) {
+        size_t left = K.nodes[2 * x].len;
+        if (off - *start < left || (atEnd && off - *start == left)) {
+            x = 2 * x;
+        } else {
+            *start += left;
+            x = 2 * x + 1;
+        }
+    }
+    return x;
+}
+
+/*
+ * Builds the bracket tree over the whole document, splitting it into
+ * leaves of BRACKET_CHUNK bytes.
+ */
+static void bracketBuild(void) {
+    size_t leaves = E.docLen ? (E.docLen + BRACKET_CHUNK - 1) / BRACKET_CHUNK : 1;
+    size_t size = 1;
+    while (size < leaves) size *= 2;
+    if (size != K.size || K.nodes == NULL) {
+        free(K.nodes);
+        K.nodes = malloc(2 * size * sizeof(struct bracketNode));
+        if (K.nodes == NULL) die("malloc");
+        K.size = size;
+    }
+    memset(K.nodes, 0, 2 * size * sizeof(struct bracketNode));
+    for (size_t i = 0, off = 0; i < leaves; i++, off += BRACKET_CHUNK) {
+        K.nodes[size + i].len = E.docLen - off < BRACKET_CHUNK ? E.docLen - off : BRACKET_CHUNK;
+        bracketSummarize(size + i, off);
+    }
+    for (size_t x = size - 1; x >= 1; x--) bracketPull(x);
+    K.built = true;
+    K.version = E.version;
+    K.len = E.docLen;
+}
+
+/*
+ * Makes sure the bracket tree matches the document. A small document is
+ * summarized as soon as it is needed; a large one only when asked for,
+ * so drawing the cursor never starts a long scan.
+ * Args:
+ *   force - Whether to build the tree whatever the document's size.
+ * Returns:
+ *   Whether the tree is current.
+ */
+static bool bracketReady(bool force) {
+    if (K.built && K.version == E.version && K.len == E.docLen) return true;
+    if (!force && E.docLen > BRACKET_EAGER_BYTES) return false;
+    bracketBuild();
+    return true;
+}
+
+/*
+ * Scans the document forward for the bracket closing one of a kind.
+ * Args:
+ *   from, to - Range to scan.
+ *   k - Kind of the bracket.
+ *   d - Pointer to the depth reached so far, updated.
+ * Returns:
+ *   Offset of the closing bracket, or SIZE_MAX if it is past the range.
+ */
+static size_t bracketScanForward(size_t from, size_t to, int k, int32_t *d) {
+    for (size_t off = from; off < to;) {
+        size_t n = bracketRun(off, to);
+        const char *p = editorDocBytes(off, n);
+        for (size_t i = bracketNext(p, 0, n); i < n; i = bracketNext(p, i + 1, n)) {
+            if (bracketKind(p[i]) != k) continue;
+            *d += p[i] == '(' || p[i] == '[' || p[i] == '{' ? 1 : -1;
+            if (*d < 0) return off + i;
+        }
+        off += n;
+    }
+    return SIZE_MAX;
+}
+
+/*
+ * Scans the document backward for the bracket opening one of a kind.
+ * Args:
+ *   from, to - Range to scan, from its end.
+ *   k - Kind of the bracket.
+ *   d - Pointer to the depth reached so far, counted from the end.
+ * Returns:
+ *   Offset of the opening bracket, or SIZE_MAX if it is before the range.
+ */
+static size_t bracketScanBackward(size_t from, size_t to, int k, int32_t *d) {
+    while (to > from) {
+        size_t n = to - from < SCAN_CHUNK ? to - from : SCAN_CHUNK;
+        const char *p = editorDocBytes(to - n, n);
+        for (size_t i = bracketPrev(p, n); i > 0; i = bracketPrev(p, i - 1)) {
+            char c = p[i - 1];
+            if (bracketKind(c) != k) continue;
+            *d += c == '(' || c == '[' || c == '{' ? 1 : -1;
+            if (*d > 0) return to - n + i - 1;
+        }
+        to -= n;
+    }
+    return SIZE_MAX;
+}
+
+/*
+ * Finds the bracket matching one. The rest of the bracket's leaf is
+ * scanned, then the tree is climbed until a sibling's summary shows the
+ * depth coming back within it, and descended into that sibling the same
+ * way, so only two leaves are ever read.
+ * Args:
+ *   off - Offset of a bracket byte. The tree must be current.
+ * Returns:
+ *   Offset of the matching bracket, or SIZE_MAX if it has none.
+ */
+static size_t bracketMatch(size_t off) {
+    char c = *editorDocBytes(off, 1);
+    int k = bracketKind(c);
+    if (k == -1) return SIZE_MAX;
+    bool open = c == '(' || c == '[' || c == '{';
+    size_t start, x = bracketLocate(off, false, &start), found;
+    int32_t d = 0;
+
+    if (open) {
+        found = bracketScanForward(off + 1, start + K.nodes[x].len, k, &d);
+        if (found != SIZE_MAX) return found;
+        for (; x > 1; x /= 2) {
+            if ((x & 1) == 0 && d + K.nodes[x + 1].minPrefix[k] < 0) break;
+            if ((x & 1) == 0) d += K.nodes[x + 1].delta[k];
+        }
+        if (x == 1) return SIZE_MAX;
+        for (x++; x < K.size;) {
+            const struct bracketNode *l = &K.nodes[2 * x];
+            if (d + l->minPrefix[k] < 0) {
+                x = 2 * x;
+            } else {
+                d += l->delta[k];
+                x = 2 * x + 1;
+            }
+        }
+        start = bracketLeafStart(x);
+        return bracketScanForward(start, start + K.nodes[x].len, k, &d);
+    }
+
+    found = bracketScanBackward(start, off, k, &d);
+    if (found != SIZE_MAX) return found;
+    for (; x > 1; x /= 2) {
+        if ((x & 1) && d + bracketMaxSuffix(&K.nodes[x - 1], k) > 0) break;
+        if (x & 1) d += K.nodes[x - 1].delta[k];
+    }
+    if (x == 1) return SIZE_MAX;
+    for (x--; x < K.size;) {
+        const struct bracketNode *r = &K.nodes[2 * x + 1];
+        if (d + bracketMaxSuffix(r, k) > 0) {
+            x = 2 * x + 1;
+        } else {
+            d += r->delta[k];
+            x = 2 * x;
+        }
+    }
+    start = bracketLeafStart(x);
+    return bracketScanBackward(start, start + K.nodes[x].len, k, &d);
+}
+
+/*
+ * Returns the offset of the bracket under a cursor, or of the one just
+ * before it, or SIZE_MAX if there is neither.
+ */
+static size_t bracketAt(size_t off) {
+    if (off < E.docLen && bracketKind(*editorDocBytes(off, 1)) != -1) return off;
+    if (off > 0 && bracketKind(*editorDocBytes(off - 1, 1)) != -1) return off - 1;
+    return SIZE_MAX;
+}
+
+/*
+ * Changes the length of a leaf and of the nodes above it.
+ */
+static void bracketResize(size_t leaf, size_t add, size_t sub) {
+    for (size_t x = leaf; x >= 1; x /= 2) K.nodes[x].len = K.nodes[x].len + add - sub;
+}
+
+/*
+ * Notes a leaf an edit batch changed.
+ */
+static void bracketDirty(size_t leaf) {
+    if (K.ndirty && K.dirty[K.ndirty - 1] == leaf) return;
+    if (K.ndirty == K.dirtyCap) {
+        K.dirtyCap = K.dirtyCap ? K.dirtyCap * 2 : 64;
+        K.dirty = realloc(K.dirty, K.dirtyCap * sizeof(size_t));
+        if (K.dirty == NULL) die("realloc");
+    }
+    K.dirty[K.ndirty++] = leaf;
+}
+
+/*
+ * Moves the bracket tree along with an edit batch. Each edit resizes the
+ * leaves it touches, and once the whole batch is in, only those leaves
+ * are scanned again and the nodes above them recomputed. A leaf grown
+ * past BRACKET_CHUNK_MAX leaves the tree to be built afresh instead.
+ * Args:
+ *   edits - The batch, sorted, offsets as before it.
+ *   n - Number of edits.
+ *   oldLen - Length of the document before the batch.
+ */
+static void bracketApplyEdits(const struct edit *edits, size_t n, size_t oldLen) {
+    // The batch already counts in E.version
+    if (!K.built || K.version + 1 != E.version || K.len != oldLen) {
+        K.built = false;
+        return;
+    }
+    K.ndirty = 0;
+    size_t delta = 0, start, x; // delta wraps when the document shrank
+    for (size_t e = 0; e < n; e++) {
+        size_t off = edits[e].off + delta;
+        for (size_t left = edits[e].del; left > 0;) {
+            x = bracketLocate(off, false, &start);
+            size_t cut = start + K.nodes[x].len - off < left ? start + K.nodes[x].len - off : left;
+            bracketResize(x, 0, cut);
+            bracketDirty(x);
+            left -= cut;
+        }
+        if (edits[e].insLen) {
+            x = bracketLocate(off, true, &start);
+            bracketResize(x, edits[e].insLen, 0);
+            bracketDirty(x);
+            if (K.nodes[x].len > BRACKET_CHUNK_MAX) {
+                K.built = false;
+                return;
+            }
+        }
+        delta += edits[e].insLen - edits[e].del;
+    }
+
+    // Edits are sorted, so the leaves they touched are too
+    size_t m = 0;
+    for (size_t i = 0; i < K.ndirty; i++) {
+        if (m == 0 || K.dirty[m - 1] != K.dirty[i]) K.dirty[m++] = K.dirty[i];
+    }
+    for (size_t i = 0; i < m; i++) bracketSummarize(K.dirty[i], bracketLeafStart(K.dirty[i]));
+    for (size_t i = 0; i < m; i++) {
+        for (x = K.dirty[i] / 2; x >= 1; x /= 2) bracketPull(x);
+    }
+    K.version = E.version;
+    K.len = E.docLen;
+}
+
+/*
+ * Finds the bracket under or just before the cursor and its match, and
+ * notes where to mark them on screen. The bracket under the cursor is
+ * left to the cursor.
+ */
+static void bracketHighlight(void) {
+    K.nhl = 0;
+    if (E.cy >= E.numrows || !bracketReady(false)) return;
+    size_t off = editorRowStart(E.cy) + E.cx, at = bracketAt(off);
+    if (at == SIZE_MAX) return;
+    size_t match = bracketMatch(at);
+    if (match == SIZE_MAX) return;
+    size_t marks[2] = {match, at};
+    for (int i = 0; i < (at == off ? 1 : 2); i++) {
+        long row = editorRowAtOffset(marks[i]);
+        int len;
+        const char *s = editorRowAt(row, &len);
+        K.hlRow[K.nhl] = row;
+        K.hlRx[K.nhl++] = editorCxToRx(s, len, marks[i] - editorRowStart(row));
+    }
+}
+
+/*** Output Writer ***/
+
+/*
+ * Sets up the frame writer. The terminal is reopened so that only the
+ * output side becomes non-blocking: stdin and stdout usually share one
+ * open file description, and stdin must keep its VTIME read timeout.
+ * Falls back to blocking writes on stdout when the reopen fails.
+ */
+static void writerInit(void) {
+    const char *tty = L.replay ? "/dev/null" : ttyname(STDOUT_FILENO);
+    W.fd = tty ? open(tty, O_WRONLY | O_NOCTTY | O_NONBLOCK) : -1;
+    if (W.fd == -1) W.fd = STDOUT_FILENO;
+    W.frame = W.queued = NULL;
+    W.len = W.off = W.queuedLen = 0;
+    W.dropped = 0;
+}
+
+/*
+ * Returns true while a frame is still waiting to be written.
+ */
+static bool writerPending(void) {
+    return W.frame != NULL;
+}
+
+/*
+ * Returns true if submitting a frame now would drop an unwritten one.
+ */
+static bool writerWillDrop(void) {
+    return W.frame != NULL && (W.off == 0 || W.queued != NULL);
+}
+
+/*
+ * Writes as much of the pending output as the terminal accepts without
+ * blocking. A finished frame is replaced by the queued one, if any.
+ */
+static void writerFlush(void) {
+    while (W.frame) {
+        uint64_t start = monotonicNs();
+        ssize_t n = write(W.fd, W.frame + W.off, W.len - W.off);
+        P.writeNs += monotonicNs() - start;
+        traceEnd("write", start, n);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            die("write");
+        }
+        W.off += n;
+        if (W.off < W.len) continue;
+
+        uint64_t took = monotonicNs() - W.submitted;
+        E.writeLatency = E.writeLatency - E.writeLatency / 8 + took / 8;
+        P.lastWriteNs = P.writeNs;
+        P.writeNs = 0;
+        free(W.frame);
+        W.frame = W.queued;
+        W.len = W.queuedLen;
+        W.submitted = W.queuedAt;
+        W.off = 0;
+        W.queued = NULL;
+    }
+}
+
+/*
+ * Hands a complete frame to the writer, which takes ownership of it.
+ * A frame that has not started going out yet is stale once a newer one
+ * exists, so it is dropped. A partially written frame is finished first,
+ * since cutting it could leave the terminal inside an escape sequence.
+ * Args:
+ *   b - The frame bytes, allocated with malloc.
+ *   len - Length of the frame.
+ */
+static void writerSubmit(char *b, int len) {
+    uint64_t now = monotonicNs();
+    if (W.frame == NULL || W.off == 0) {
+        if (W.frame) W.dropped++;
+        free(W.frame);
+        W.frame = b;
+        W.len = len;
+        W.off = 0;
+        W.submitted = now;
+    } else {
+        if (W.queued) W.dropped++;
+        free(W.queued);
+        W.queued = b;
+        W.queuedLen = len;
+        W.queuedAt = now;
+    }
+    writerFlush();
+}
+
+/*
+ * Blocks until all pending output is written or the timeout expires.
+ * Args:
+ *   timeoutMs - Maximum time to wait for the terminal.
+ */
+static void writerDrain(int timeoutMs) {
+    uint64_t deadline = monotonicNs() + timeoutMs * NSEC_PER_MSEC;
+    writerFlush();
+    while (writerPending() && monotonicNs() < deadline) {
+        struct pollfd pfd = {W.fd, POLLOUT, 0};
+        poll(&pfd, 1, timeoutMs);
+        writerFlush();
+    }
+}
+
+/*** Panes ***/
+
+/*
+ * Stores the view held in E back into the active pane.
+ */
+static void paneSave(void) {
+    struct pane *p = &V.panes[V.active];
+    p->cx = E.cx;
+    p->cy = E.cy;
+    p->rx = E.rx;
+    p->rowoff = E.rowoff;
+    p->coloff = E.coloff;
+}
+
+/*
+ * Makes a pane the active one, loading its view into E. The view is
+ * clamped, as the document may have changed while another pane had it.
+ * Args:
+ *   i - Index of the pane.
+ */
+static void paneLoad(int i) {
+    struct pane *p = &V.panes[i];
+    V.active = i;
+    E.cx = p->cx;
+    E.cy = p->cy;
+    E.rx = p->rx;
+    E.rowoff = p->rowoff;
+    E.coloff = p->coloff;
+    E.screenRows = p->rows;
+    E.screenCols = p->cols;
+    editorClampCursor();
+}
+
+/*
+ * Gives a pane a shadow tall enough for any height the pane can grow
+ * to, so closing neighbours never needs to resize it.
+ * Args:
+ *   p - The pane.
+ */
+static void paneAllocShadow(struct pane *p) {
+    p->shadow = calloc(E.termRows - MESSAGE_BAR_ROWS, sizeof(struct screenLine));
+    if (p->shadow == NULL) die("calloc");
+}
+
+/*
+ * Frees a pane's shadow.
+ * Args:
+ *   p - The pane.
+ */
+static void paneFreeShadow(struct pane *p) {
+    for (int y = 0; y < E.termRows - MESSAGE_BAR_ROWS; y++) free(p->shadow[y].b);
+    free(p->shadow);
+    p->shadow = NULL;
+}
+
+/*
+ * Points every pane but the active one at the view in E, after the
+ * panes' document was replaced by another buffer.
+ */
+static void paneShareView(void) {
+    for (int i = 0; i < V.npanes; i++) {
+        if (i == V.active) continue;
+        V.panes[i].cx = E.cx;
+        V.panes[i].cy = E.cy;
+        V.panes[i].rx = 0;
+        V.panes[i].rowoff = E.rowoff;
+        V.panes[i].coloff = E.coloff;
+    }
+}
+
+/*
+ * Sets up a single pane covering the screen above the message bar.
+ */
+static void paneInit(void) {
+    struct pane *p = &V.panes[0];
+    p->top = p->left = 0;
+    p->rows = E.termRows - MESSAGE_BAR_ROWS;
+    p->cols = E.termCols;
+    p->drawnRowoff = 0;
+    paneAllocShadow(p);
+    V.npanes = 1;
+    V.prefix = false;
+    V.bar.b = NULL;
+    paneLoad(0);
+}
+
+/*** Output functions ***/
+
+/*
+ * Adjusts the row and column offsets so the cursor stays on screen.
+ */
+static void editorScroll(void) {
+    long fold = foldHiding(E.cy);
+    if (fold != -1) foldRemove(fold); // Moving into a fold opens it
+    E.rowoff = foldRowBelow(E.rowoff, 0);
+
+    E.rx = 0;
+    if (E.cy < E.numrows) {
+        int len;
+        const char *row = editorRowAt(E.cy, &len);
+        E.rx = editorCxToRx(row, len, E.cx);
+    }
+
+    long cv = foldRowToVisual(E.cy), top = foldRowToVisual(E.rowoff);
+    if (cv < top) E.rowoff = E.cy;
+    if (cv >= top + E.screenRows) E.rowoff = foldVisualToRow(cv - E.screenRows + 1);
+    if (E.rx < E.coloff) E.coloff = E.rx;
+    if (E.rx >= E.coloff + E.screenCols) E.coloff = E.rx - E.screenCols + 1;
+}
+
+/*
+ * Returns the rendered form of a document row, reusing the cached render
+ * while the document has not changed since it was built.
+ * Args:
+ *   row - Row index, must be less than E.numrows.
+ * Returns:
+ *   The cache entry holding the render; valid until the next lookup.
+ */
+static const struct renderEntry *editorRowRender(long row) {
+    int i;
+    for (i = RC.buckets[renderCacheBucket(row)]; i != -1; i = RC.entries[i].hashNext) {
+        if (RC.entries[i].row == row) break;
+    }
+
+    struct renderEntry *e;
+    if (i != -1) {
+        e = &RC.entries[i];
+        renderCacheLruUnlink(i);
+        renderCacheLruPushFront(i);
+        if (e->version == E.version) return e;
+        RC.bytes -= e->rsize;
+        free(e->render);
+    } else {
+        i = renderCacheAlloc();
+        e = &RC.entries[i];
+        e->row = row;
+        e->hashNext = RC.buckets[renderCacheBucket(row)];
+        RC.buckets[renderCacheBucket(row)] = i;
+        renderCacheLruPushFront(i);
+    }
+
+    struct abuf render = ABUF_INIT;
+    int len;
+    const char *chars = editorRowAt(row, &len);
+    e->narrow = G.on ? tableRenderRow(chars, len, &render) : editorRenderRow(chars, len, &render);
+    e->render = render.b;
+    e->rsize = render.len;
+    e->version = E.version;
+    RC.bytes += e->rsize;
+
+    // Keep the cache within its memory budget, but never drop this entry
+    while (RC.bytes > RENDER_CACHE_MAX_BYTES && RC.lruTail != i) {
+        renderCacheEvict(RC.lruTail);
+    }
+    return e;
+}
+
+/*
+ * Draws the visible columns of a rendered row. A wide character cut by
+ * either screen edge is replaced with spaces.
+ * Args:
+ *   ab - Pointer to the append buffer to store the output.
+ *   r - The rendered row.
+ *   rlen - Length of the rendered row.
+ *   narrow - true if every byte of the render is one column.
+ *   coloff - First display column to draw.
+ *   cols - Number of screen columns available.
+ * Returns:
+ *   The number of columns drawn.
+ */
+static int editorDrawRender(struct abuf *ab, const char *r, int rlen, bool narrow,
+                            int coloff, int cols) {
+    int i = 0, col = 0, used = 0, w;
+
+    if (narrow) {
+        int len = rlen - coloff;
+        if (len > cols) len = cols;
+        if (len <= 0) return 0;
+        abAppend(ab, &r[coloff], len);
+        return len;
+    }
+
+    while (i < rlen && col < coloff) {
+        if (coloff - col >= ASCII_CHUNK && asciiRunAt(r, rlen, i)) {
+            i += ASCII_CHUNK;
+            col += ASCII_CHUNK;
+            continue;
+        }
+        i = editorClusterStep(r, rlen, i, col, &w);
+        col += w;
+    }
+    for (; col > coloff && used < cols; col--, used++) {
+        abAppend(ab, " ", 1);
+    }
+
+    int start = i;
+    while (i < rlen && used < cols) {
+        if (cols - used >= ASCII_CHUNK && asciiRunAt(r, rlen, i)) {
+            i += ASCII_CHUNK;
+            used += ASCII_CHUNK;
+            continue;
+        }
+        int next = editorClusterStep(r, rlen, i, used, &w);
+        if (used + w > cols) break;
+        used += w;
+        i = next;
+    }
+    abAppend(ab, &r[start], i - start);
+    return used;
+}
+
+/*
+ * Draws one line of the performance overlay, padded to HUD_WIDTH.
+ * Args:
+ *   ab - Pointer to the append buffer to store the output.
+ *   line - Overlay line to draw, 0 to HUD_ROWS - 1.
+ */
+static void editorDrawHudLine(struct abuf *ab, int line) {
+    char buf[HUD_WIDTH + 1];
+    double ms = 1.0 / NSEC_PER_MSEC;
+
+    switch (line) {
+        case 0: snprintf(buf, sizeof(buf), " Performance (Ctrl-P to hide)"); break;
+        case 1: snprintf(buf, sizeof(buf), " frame build %8.3f ms", P.lastBuildNs * ms); break;
+        case 2: snprintf(buf, sizeof(buf), " abAppend %7llu B %6llu allocs",
+                         (unsigned long long)P.lastAbBytes,
+                         (unsigned long long)P.lastAbAllocs); break;
+        case 3: snprintf(buf, sizeof(buf), " write %6.3f ms  frame %7d B",
+                         P.lastWriteNs * ms, P.lastFrameBytes); break;
+        case 4: snprintf(buf, sizeof(buf), " input queue %8d B", P.inputDepth); break;
+        default: snprintf(buf, sizeof(buf), " rss %16ld KB", P.rssKb); break;
+    }
+
+    int len = strlen(buf);
+    abAppend(ab, "\x1b[7m", 4); // Reverse video
+    abAppend(ab, buf, len);
+    while (len++ < HUD_WIDTH) abAppend(ab, " ", 1);
+    abAppend(ab, "\x1b[m", 3);
+}
+
+/*
+ * Samples the metrics that are read from the system rather than counted.
+ */
+static void editorSampleHud(void) {
+    if (ioctl(STDIN_FILENO, FIONREAD, &P.inputDepth) == -1) P.inputDepth = 0;
+
+    long pages = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp) {
+        if (fscanf(fp, "%*s %ld", &pages) != 1) pages = 0;
+        fclose(fp);
+    }
+    P.rssKb = pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/*
+ * Sets the message shown in the message bar for MESSAGE_TIMEOUT seconds.
+ * Args:
+ *   fmt - printf-style format string.
+ */
+static void editorSetStatusMessage(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
+    va_end(ap);
+    E.statusmsgTime = time(NULL);
+}
+
+/*
+ * Draws the message bar below the document: the prompt while one is
+ * open, otherwise the status message until it times out.
+ * Args:
+ *   ab - Pointer to the append buffer to store the output.
+ */
+static void editorDrawMessageBar(struct abuf *ab) {
+    char msg[sizeof(E.statusmsg) + PROMPT_MAX];
+    int len = 0;
+    if (E.promptLabel) {
+        len = snprintf(msg, sizeof(msg), E.promptLabel, E.promptBuf);
+    } else if (E.statusmsg[0] && time(NULL) - E.statusmsgTime < MESSAGE_TIMEOUT) {
+        len = snprintf(msg, sizeof(msg), "%s", E.statusmsg);
+    }
+    if (len >= (int)sizeof(msg)) len = sizeof(msg) - 1;
+    if (len > E.termCols) len = E.termCols;
+    abAppend(ab, msg, len);
+}
+
+/*
+ * Draws a rendered row with some column ranges in a given style.
+ * Args:
+ *   ab - Pointer to the append buffer to store the output.
+ *   r - The row's render.
+ *   coloff - First display column to draw.
+ *   cols - Number of columns available.
+ *   from - First display column of each range, ascending.
+ *   to - Display column just past each range; ranges do not overlap.
+ *   n - Number of ranges.
+ *   sgr - Escape sequence that starts the style.
+ * Returns:
+ *   The number of columns drawn.
+ */
+static int editorDrawMarked(struct abuf *ab, const struct renderEntry *r, int coloff,
+                            int cols, const int *from, const int *to, int n,
+                            const char *sgr) {
+    int col = coloff, used = 0;
+    for (int i = 0; i < n; i++) {
+        int start = from[i] > col ? from[i] : col;
+        int end = to[i] < coloff + cols ? to[i] : coloff + cols;
+        if (start >= end) continue;
+        used += editorDrawRender(ab, r->render, r->rsize, r->narrow, col, start - col);
+        while (used < start - coloff) {
+            abAppend(ab, " ", 1);
+            used++;
+        }
+        abAppend(ab, sgr, strlen(sgr));
+        int w = editorDrawRender(ab, r->render, r->rsize, r->narrow, start, end - start);
+        for (; w < end - start; w++) abAppend(ab, " ", 1); // Past the end of the row
+        abAppend(ab, "\x1b[m", 3);
+        used += end - start;
+        col = end;
+    }
+    return used + editorDrawRender(ab, r->render, r->rsize, r->narrow, col, cols - used);
+}
+
+/*
+ * Draws a rendered row with the extra cursors on it shown in reverse
+ * video. The cursors are found with a binary search over their offsets.
+ * Args:
+ *   ab - Pointer to the append buffer to store the output.
+ *   r - The row's render.
+ *   filerow - The row.
+ *   coloff - First display column to draw.
+ *   cols - Number of columns available.
+ * Returns:
+ *   The number of columns drawn.
+ */
+static int editorDrawCursorRow(struct abuf *ab, const struct renderEntry *r, long filerow,
+                               int coloff, int cols) {
+    size_t start = editorRowStart(filerow);
+    size_t lo = 0, hi = C.n;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (C.offs[mid] < start) lo = mid + 1;
+        else hi = mid;
+    }
+
+    int len, from[CURSOR_DRAW_MAX], to[CURSOR_DRAW_MAX], n = 0;
+    const char *row = editorRowAt(filerow, &len);
+    for (; lo < C.n && C.offs[lo] <= start + len && n < CURSOR_DRAW_MAX; lo++) {
+        from[n] = editorCxToRx(row, len, C.offs[lo] - start);
+        to[n] = from[n] + 1;
+        n++;
+    }
+    return editorDrawMarked(ab, r, coloff, cols, from, to, n, "\x1b[7m");
+}
+
+/*
+ * Returns the rows and display columns of the block selection. The
+ * columns are the boundaries between cells, so a block can be empty.
+ * Args:
+ *   rx - Display column of the cursor in E.
+ *   r0, r1 - Pointers to store the first and last row.
+ *   c0, c1 - Pointers to store the first column and the one past the last.
+ */
+static void editorBlockBounds(int rx, long *r0, long *r1, int *c0, int *c1) {
+    *r0 = C.blockRow < E.cy ? C.blockRow : E.cy;
+    *r1 = C.blockRow < E.cy ? E.cy : C.blockRow;
+    if (*r1 >= E.numrows) *r1 = E.numrows - 1;
+    *c0 = C.blockRx < rx ? C.blockRx : rx;
+    *c1 = C.blockRx < rx ? rx : C.blockRx;
+}
+
+/*
+ * Draws the content of one row of a pane: a document row, or a tilde and
+ * the welcome message when no file is open.
+ * Args:
+ *   ab - Pointer to the append buffer to store the output.
+ *   p - The pane.
+ *   y - Row within the pane.
+ * Returns:
+ *   The number of columns drawn.
+ */
+static int editorDrawRow(struct abuf *ab, const struct pane *p, int y) {
+    long filerow = foldRowBelow(p->rowoff, y);
+    long r0 = 0, r1 = -1;
+    int c0 = 0, c1 = 0;
+    if (C.block) editorBlockBounds(E.rx, &r0, &r1, &c0, &c1);
+    bool hud = E.hud && p->top + y < HUD_ROWS && p->left + p->cols == E.termCols &&
+               p->cols >= 2 * HUD_WIDTH;
+    int cols = hud ? p->cols - HUD_WIDTH : p->cols;
+    int used;
+
+    if (filerow >= E.numrows) {
+        if (E.numrows == 0 && y == p->rows / 3) {
+            char welcome[80];
+            int welcomelen = snprintf(welcome, sizeof(welcome),
+                                     "Lekhani editor -- version %s", VERSION);
+            if (welcomelen > cols) welcomelen = cols;
+            int padding = (cols - welcomelen) / 2;
+            used = padding + welcomelen;
+            if (padding) {
+                abAppend(ab, "~", 1);
+                padding--;
+            }
+            while (padding--) abAppend(ab, " ", 1);
+            abAppend(ab, welcome, welcomelen);
+        } else {
+            abAppend(ab, "~", 1);
+            used = 1;
+        }
+    } else {
+        const struct renderEntry *r = editorRowRender(filerow);
+        if (filerow >= r0 && filerow <= r1) {
+            if (c1 == c0) c1++; // An empty block still shows where it is
+            used = editorDrawMarked(ab, r, p->coloff, cols, &c0, &c1, 1, "\x1b[7m");
+        } else if (C.n) {
+            used = editorDrawCursorRow(ab, r, filerow, p->coloff, cols);
+        } else {
+            int from[2], to[2], n = 0;
+            for (int i = 0; i < K.nhl; i++) {
+                if (K.hlRow[i] != filerow) continue;
+                from[n] = K.hlRx[i];
+                to[n++] = K.hlRx[i] + 1;
+            }
+            if (n == 2 && from[1] < from[0]) { // Both on the row, in the wrong order
+                int t = from[0];
+                from[0] = from[1];
+                from[1] = t;
+                to[0] = from[0] + 1;
+                to[1] = from[1] + 1;
+            }
+            used = editorDrawMarked(ab, r, p->coloff, cols, from, to, n, "\x1b[4m"); // Underline
+        }
+
+        size_t k = foldBefore(filerow);
+        if (k < F.n && F.folds[k].first == filerow) {
+            char mark[32];
+            int len = snprintf(mark, sizeof(mark), " [+%ld rows]", F.folds[k].last - filerow);
+            if (len > cols - used) len = cols - used;
+            if (len > 0) {
+                abAppend(ab, "\x1b[2m", 4); // Dim
+                abAppend(ab, mark, len);
+                abAppend(ab, "\x1b[m", 3);
+                used += len;
+            }
+        }
+    }
+
+    if (hud) {
+        while (used++ < cols) abAppend(ab, " ", 1);
+        editorDrawHudLine(ab, p->top + y);
+        used = p->cols;
+    }
+    return used;
+}
+
+/*
+ * Forgets what the terminal shows, so the next frame redraws every pane,
+ * the lines between them and the message bar.
+ */
+static void editorInvalidateScreen(void) {
+    for (int i = 0; i < V.npanes; i++) {
+        struct pane *p = &V.panes[i];
+        for (int y = 0; y < p->rows; y++) p->shadow[y].len = -1;
+        p->drawnColoff = -1; // Nothing to scroll either
+    }
+    V.bar.len = -1;
+    V.separatorsDrawn = false;
+}
+
+/*
+ * Moves the rows already in a pane when its view scrolled vertically by
+ * less than the pane's height, using a scroll region (DECSTBM) and
+ * scroll up/down (SU/SD). A scroll region spans the whole terminal
+ * width, so only full-width panes scroll this way. The shadow is shifted
+ * the same way; the rows scrolled in are blank on the terminal, so only
+ * they are left for editorDrawPane.
+ * Args:
+ *   ab - Pointer to the append buffer to store the output.
+ *   p - The pane.
+ */
+static void editorScrollPane(struct abuf *ab, struct pane *p) {
+    long delta = foldRowToVisual(p->rowoff) - foldRowToVisual(p->drawnRowoff);
+    if (p->coloff != p->drawnColoff || delta == 0 || labs(delta) >= p->rows) return;
+    if (p->cols != E.termCols) return;
+
+    int n = labs(delta);
+    char buf[48];
+    snprintf(buf, sizeof(buf), "\x1b[%d;%dr\x1b[%d%c\x1b[r", p->top + 1, p->top + p->rows,
+             n, delta > 0 ? 'S' : 'T');
+    abAppend(ab, buf, strlen(buf));
+
+    // Rotate the shadow; the rows that left the pane become the blank ones
+    struct screenLine moved[n];
+    if (delta > 0) {
+        memcpy(moved, p->shadow, n * sizeof(*moved));
+        memmove(p->shadow, p->shadow + n, (p->rows - n) * sizeof(*moved));
+        memcpy(p->shadow + p->rows - n, moved, n * sizeof(*moved));
+        for (int y = p->rows - n; y < p->rows; y++) p->shadow[y].len = 0;
+    } else {
+        memcpy(moved, p->shadow + p->rows - n, n * sizeof(*moved));
+        memmove(p->shadow + n, p->shadow, (p->rows - n) * sizeof(*moved));
+        memcpy(p->shadow, moved, n * sizeof(*moved));
+        for (int y = 0; y < n; y++) p->shadow[y].len = 0;
+    }
+}
+
+/*
+ * Emits a line of screen content if it differs from what the terminal
+ * shows there, then keeps it as the new shadow.
+ * Args:
+ *   ab - Pointer to the append buffer to store the output.
+ *   sl - Shadow of the line.
+ *   line - New content; its buffer is swapped with the shadow's.
+ *   y - Screen row.
+ *   x - Screen column the line starts at.
+ *   width - Columns the line owns, 0 if it extends to the right edge.
+ *   used - Columns the new content takes.
+ */
+static void editorDrawLine(struct abuf *ab, struct screenLine *sl, struct abuf *line,
+                           int y, int x, int width, int used) {
+    if (sl->len == line->len && (line->len == 0 || memcmp(sl->b, line->b, line->len) == 0)) {
+        return;
+    }
+
+    char buf[32];
+    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
+    abAppend(ab, buf, strlen(buf));
+    abAppend(ab, line->b, line->len);
+    if (width == 0) {
+        abAppend(ab, "\x1b[K", 3); // Clear line from cursor to end
+    } else if (used < width) {
+        // Erase only up to the next pane
+        snprintf(buf, sizeof(buf), "\x1b[%dX", width - used);
+        abAppend(ab, buf, strlen(buf));
+    }
+
+    // The line buffer becomes the shadow; the old shadow is reused
+    char *old = sl->b;
+    sl->b = line->b;
+    sl->len = line->len;
+    line->b = old;
+}
+
+/*
+ * Draws the rows of a pane whose content differs from what the terminal
+ * shows, so each pane only costs the rows that changed in it.
+ * Args:
+ *   ab - Pointer to the append buffer to store the output.
+ *   p - The pane.
+ */
+static void editorDrawPane(struct abuf *ab, struct pane *p) {
+    struct abuf line = ABUF_INIT;
+    int width = p->left + p->cols == E.termCols ? 0 : p->cols;
+    for (int y = 0; y < p->rows; y++) {
+        line.len = 0;
+        int used = editorDrawRow(&line, p, y);
+        editorDrawLine(ab, &p->shadow[y], &line, p->top + y, p->left, width, used);
+    }
+    abFree(&line);
+    p->drawnRowoff = p->rowoff;
+    p->drawnColoff = p->coloff;
+}
+
+/*
+ * Draws the lines between panes: every cell of the pane area that no
+ * pane covers. Drawn once per layout, or after the screen was lost.
+ * Args:
+ *   ab - Pointer to the append buffer to store the output.
+ */
+static void editorDrawSeparators(struct abuf *ab) {
+    int rows = E.termRows - MESSAGE_BAR_ROWS, cols = E.termCols;
+    char *covered = calloc((size_t)rows * cols, 1);
+    if (covered == NULL) die("calloc");
+    for (int i = 0; i < V.npanes; i++) {
+        struct pane *p = &V.panes[i];
+        for (int y = p->top; y < p->top + p->rows; y++) {
+            memset(covered + (size_t)y * cols + p->left, 1, p->cols);
+        }
+    }
+
+    abAppend(ab, "\x1b[2m", 4); // Dim
+    for (int y = 0; y < rows; y++) {
+        for (int x = 0; x < cols; x++) {
+            if (covered[(size_t)y * cols + x]) continue;
+            bool vertical = (y > 0 && !covered[(size_t)(y - 1) * cols + x]) ||
+                            (y + 1 < rows && !covered[(size_t)(y + 1) * cols + x]);
+            char buf[32];
+            snprintf(buf, sizeof(buf), "\x1b[%d;%dH%c", y + 1, x + 1, vertical ? '|' : '-');
+            abAppend(ab, buf, strlen(buf));
+        }
+    }
+    abAppend(ab, "\x1b[m", 3);
+    free(covered);
+    V.separatorsDrawn = true;
+}
+
+/*
+ * Refreshes the editor screen: every pane, the lines between them, the
+ * message bar and the cursor, in one frame.
+ */
+static void editorRefreshScreen(void) {
+    E.lastFrame = monotonicNs();
+    P.abBytes = P.abAllocs = 0;
+    if (E.hud) editorSampleHud();
+    editorScroll();
+    if (G.on && tableFitView()) editorScroll(); // The cursor's column may have moved
+    bracketHighlight();
+    paneSave();
+
+    // Frames only carry changed rows, so one that replaces a dropped frame
+    // cannot rely on what that frame would have drawn
+    if (writerWillDrop()) editorInvalidateScreen();
+
+    struct abuf ab = ABUF_INIT;
+
+    // Let the terminal show the frame atomically, or at least hide the cursor
+    if (E.syncOutput) abAppend(&ab, "\x1b[?2026h", 8); // Begin synchronized update
+    else abAppend(&ab, "\x1b[?25l", 6); // Hide cursor
+    if (!V.separatorsDrawn && V.npanes > 1) editorDrawSeparators(&ab);
+    for (int i = 0; i < V.npanes; i++) {
+        editorScrollPane(&ab, &V.panes[i]);
+        editorDrawPane(&ab, &V.panes[i]);
+    }
+
+    struct abuf line = ABUF_INIT;
+    editorDrawMessageBar(&line);
+    editorDrawLine(&ab, &V.bar, &line, E.termRows - MESSAGE_BAR_ROWS, 0, 0, line.len);
+    abFree(&line);
+
+    char buf[32];
+    if (E.promptLabel) {
+        int col = snprintf(NULL, 0, E.promptLabel, E.promptBuf);
+        if (col >= E.termCols) col = E.termCols - 1;
+        snprintf(buf, sizeof(buf), "\x1b[%d;%dH", E.termRows, col + 1);
+    } else {
+        struct pane *p = &V.panes[V.active];
+        snprintf(buf, sizeof(buf), "\x1b[%d;%dH", p->top + (int)(foldRowToVisual(E.cy) - foldRowToVisual(E.rowoff)) + 1,
+                 p->left + (E.rx - E.coloff) + 1);
+    }
+    abAppend(&ab, buf, strlen(buf)); // Move cursor to current position
+
+    if (E.syncOutput) abAppend(&ab, "\x1b[?2026l", 8); // End synchronized update
+    else abAppend(&ab, "\x1b[?25h", 6); // Show cursor
+
+    traceEnd("frame build", E.lastFrame, ab.len);
+    P.lastBuildNs = monotonicNs() - E.lastFrame;
+    P.lastFrameBytes = ab.len;
+    P.lastAbBytes = P.abBytes;
+    P.lastAbAllocs = P.abAllocs;
+    if (ab.b) writerSubmit(ab.b, ab.len);
+}
+
+/*** Pane Layout ***/
+
+/*
+ * Splits the active pane in two, separated by a line. The new pane
+ * takes the bottom or right half, starts with the same view and becomes
+ * the active one.
+ * Args:
+ *   vertical - Split side by side rather than one above the other.
+ */
+static void paneSplit(bool vertical) {
+    struct pane *p = &V.panes[V.active];
+    if (V.npanes == PANE_MAX || (vertical ? p->cols : p->rows) < 3) {
+        editorSetStatusMessage("No room to split");
+        return;
+    }
+
+    paneSave();
+    struct pane *n = &V.panes[V.npanes];
+    *n = *p;
+    n->shadow = NULL;
+    if (vertical) {
+        p->cols = (p->cols - 1) / 2;
+        n->left = p->left + p->cols + 1;
+        n->cols -= p->cols + 1;
+    } else {
+        p->rows = (p->rows - 1) / 2;
+        n->top = p->top + p->rows + 1;
+        n->rows -= p->rows + 1;
+    }
+    paneAllocShadow(n);
+    V.npanes++;
+    paneLoad(V.npanes - 1);
+    editorInvalidateScreen();
+}
+
+/*
+ * Returns whether the panes on one side of a rectangle exactly cover
+ * that side's edge, so they can grow over the rectangle.
+ * Args:
+ *   c - The rectangle, a closed pane.
+ *   side - 0 above, 1 below, 2 left, 3 right.
+ */
+static bool paneSideCovers(const struct pane *c, int side) {
+    int covered = 0, found = 0;
+    for (int i = 0; i < V.npanes; i++) {
+        struct pane *p = &V.panes[i];
+        if (p == c) continue;
+        bool adjacent;
+        if (side < 2) {
+            adjacent = side == 0 ? p->top + p->rows + 1 == c->top : c->top + c->rows + 1 == p->top;
+            if (!adjacent || p->left < c->left || p->left + p->cols > c->left + c->cols) continue;
+            covered += p->cols + 1;
+        } else {
+            adjacent = side == 2 ? p->left + p->cols + 1 == c->left : c->left + c->cols + 1 == p->left;
+            if (!adjacent || p->top < c->top || p->top + p->rows > c->top + c->rows) continue;
+            covered += p->rows + 1;
+        }
+        found++;
+    }
+    return found && covered == (side < 2 ? c->cols : c->rows) + 1;
+}
+
+/*
+ * Closes the active pane. Its space goes to the panes along one of its
+ * sides that line up with it exactly, which always exist for a layout
+ * built by splitting. The pane after it becomes active.
+ */
+static void paneClose(void) {
+    if (V.npanes == 1) {
+        editorSetStatusMessage("Only one pane");
+        return;
+    }
+
+    struct pane *c = &V.panes[V.active];
+    int side;
+    for (side = 0; side < 4 && !paneSideCovers(c, side); side++) {}
+    if (side == 4) {
+        editorSetStatusMessage("Pane can't be closed");
+        return;
+    }
+
+    for (int i = 0; i < V.npanes; i++) {
+        struct pane *p = &V.panes[i];
+        if (p == c) continue;
+        if (side == 0 && p->top + p->rows + 1 == c->top && p->left >= c->left &&
+            p->left + p->cols <= c->left + c->cols) {
+            p->rows += c->rows + 1;
+        } else if (side == 1 && c->top + c->rows + 1 == p->top && p->left >= c->left &&
+                   p->left + p->cols <= c->left + c->cols) {
+            p->top = c->top;
+            p->rows += c->rows + 1;
+        } else if (side == 2 && p->left + p->cols + 1 == c->left && p->top >= c->top &&
+                   p->top + p->rows <= c->top + c->rows) {
+            p->cols += c->cols + 1;
+        } else if (side == 3 && c->left + c->cols + 1 == p->left && p->top >= c->top &&
+                   p->top + p->rows <= c->top + c->rows) {
+            p->left = c->left;
+            p->cols += c->cols + 1;
+        }
+    }
+
+    int closed = V.active;
+    paneFreeShadow(c);
+    memmove(c, c + 1, (V.npanes - closed - 1) * sizeof(*c));
+    V.npanes--;
+    paneLoad(closed % V.npanes);
+    editorInvalidateScreen();
+}
+
+/*
+ * Closes every pane but the active one, which takes the whole screen.
+ */
+static void paneOnly(void) {
+    paneSave();
+    for (int i = 0; i < V.npanes; i++) {
+        if (i != V.active) paneFreeShadow(&V.panes[i]);
+    }
+
+    V.panes[0] = V.panes[V.active];
+    struct pane *p = &V.panes[0];
+    p->top = p->left = 0;
+    p->rows = E.termRows - MESSAGE_BAR_ROWS;
+    p->cols = E.termCols;
+    V.npanes = 1;
+    paneLoad(0);
+    editorInvalidateScreen();
+}
+
+/*
+ * Handles the key after the Ctrl-W prefix.
+ * Args:
+ *   c - The key.
+ */
+static void paneCommand(int c) {
+    switch (c) {
+        case 's':
+            paneSplit(false);
+            break;
+        case 'v':
+            paneSplit(true);
+            break;
+        case 'w':
+        case CTRL_KEY('w'):
+            paneSave();
+            paneLoad((V.active + 1) % V.npanes);
+            break;
+        case 'c':
+            paneClose();
+            break;
+        case 'o':
+            paneOnly();
+            break;
+    }
+}
+
+/*** Buffers ***/
+
+/*
+ * Sets up an empty buffer list.
+ * Args:
+ *   n - Number of files that will be added.
+ */
+static void bufferInit(int n) {
+    B.bufs = calloc(n, sizeof(struct buffer));
+    B.hashSize = 16;
+    while (B.hashSize < 2 * n) B.hashSize *= 2;
+    B.hash = malloc(B.hashSize * sizeof(int));
+    if (B.bufs == NULL || B.hash == NULL) die("malloc");
+    for (int i = 0; i < B.hashSize; i++) B.hash[i] = -1;
+    B.nbufs = 0;
+    B.current = -1;
+    B.nloaded = 0;
+    B.tick = 0;
+}
+
+/*
+ * Adds a file to the buffer list without opening it: only the path and
+ * the file's identity are kept, so adding costs one stat. A file named
+ * more than once, under any path, gets a single buffer.
+ * Args:
+ *   path - Path of the file; must outlive the buffer list.
+ */
+static void bufferAdd(const char *path) {
+    struct stat st;
+    bool exists = stat(path, &st) == 0;
+    if (exists) {
+        uint64_t h = ((uint64_t)st.st_dev * 0x9e3779b97f4a7c15ULL) ^ (uint64_t)st.st_ino;
+        int slot = (h * 0x9e3779b97f4a7c15ULL) >> 32 & (B.hashSize - 1);
+        while (B.hash[slot] != -1) {
+            struct buffer *o = &B.bufs[B.hash[slot]];
+            if (o->dev == st.st_dev && o->ino == st.st_ino) return;
+            slot = (slot + 1) & (B.hashSize - 1);
+        }
+        B.hash[slot] = B.nbufs;
+    }
+
+    struct buffer *b = &B.bufs[B.nbufs++];
+    b->path = path;
+    b->fd = -1;
+    b->table = tableExtension(path) != 0;
+    if (exists) {
+        b->dev = st.st_dev;
+        b->ino = st.st_ino;
+        b->size = st.st_size;
+        b->mtime = st.st_mtime;
+    }
+}
+
+/*
+ * Parks the shown document in its buffer, leaving E without one. The
+ * pages the budget kept resident are dropped; the index stays.
+ * Args:
+ *   b - The buffer being shown.
+ */
+static void bufferStash(struct buffer *b) {
+    b->indexShift = M.indexShift;
+    budgetRelease();
+    b->map = E.map;
+    b->mapLen = E.mapLen;
+    b->fd = E.fd;
+    b->gz = E.gz;
+    b->pt = E.pt;
+    b->lineIdx = E.lineIdx;
+    b->lineRow = E.lineRow;
+    b->lineSlots = E.lineSlots;
+    b->lineCap = E.lineCap;
+    b->lineMapLen = E.lineMapLen;
+    b->numrows = E.numrows;
+    E.map = NULL;
+    E.mapLen = E.docLen = 0;
+    E.fd = -1;
+    E.gz = NULL;
+    E.pt = NULL;
+    E.lineIdx = NULL;
+    E.lineRow = NULL;
+    E.lineSlots = 0;
+    E.lineCap = 0;
+    E.lineMapLen = 0;
+    E.numrows = 0;
+}
+
+/*
+ * Shows a parked document again.
+ * Args:
+ *   b - A loaded buffer.
+ */
+static void bufferUnstash(struct buffer *b) {
+    E.map = b->map;
+    E.mapLen = b->mapLen;
+    E.fd = b->fd;
+    E.gz = b->gz;
+    E.pt = b->pt;
+    E.docLen = b->pt ? b->pt->len : b->mapLen;
+    E.lineIdx = b->lineIdx;
+    E.lineRow = b->lineRow;
+    E.lineSlots = b->lineSlots;
+    E.lineCap = b->lineCap;
+    E.lineMapLen = b->lineMapLen;
+    E.numrows = b->numrows;
+    M.indexShift = b->indexShift;
+}
+
+/*
+ * Unmaps a parked buffer and frees its index. Only the path, the file's
+ * identity and the view are kept, so it is reloaded on its next view.
+ * Args:
+ *   b - A loaded buffer that is not shown.
+ */
+static void bufferEvict(struct buffer *b) {
+    if (b->gz) gzClose(b->gz);
+    if (b->pt) pieceFree(b->pt);
+    if (b->map) munmap(b->map, b->mapLen);
+    if (b->fd != -1) close(b->fd);
+    lineIdxFree(b->lineIdx, b->lineMapLen);
+    free(b->lineRow);
+    b->map = NULL;
+    b->gz = NULL;
+    b->pt = NULL;
+    b->fd = -1;
+    b->lineIdx = NULL;
+    b->lineRow = NULL;
+    b->lineSlots = 0;
+    b->lineCap = 0;
+    b->lineMapLen = 0;
+    b->numrows = 0;
+    b->loaded = false;
+    B.nloaded--;
+}
+
+/*
+ * Shows a buffer, loading it on its first view. The buffer shown before
+ * is parked, and once more than BUFFER_MAX_LOADED buffers are loaded the
+ * least recently viewed unmodified parked one is evicted. A parked
+ * buffer whose file changed on disk is reloaded rather than shown stale,
+ * unless it has edits of its own.
+ * Args:
+ *   to - Index of the buffer to show.
+ */
+static void bufferSwitch(int to) {
+    if (E.follow) editorFollowStop();
+    C.n = 0; // Extra cursors belong to the document they were placed in
+    C.block = false;
+    F.n = 0;
+    if (B.current != -1) {
+        struct buffer *cur = &B.bufs[B.current];
+        if (cur->loaded) bufferStash(cur);
+        cur->cx = E.cx;
+        cur->cy = E.cy;
+        cur->rowoff = E.rowoff;
+        cur->coloff = E.coloff;
+        cur->table = G.on;
+    }
+
+    bool first = B.current == -1;
+    struct buffer *b = &B.bufs[to];
+    struct stat st;
+    B.current = to;
+    b->lastViewed = ++B.tick;
+    if (b->loaded && !b->pt && !E.follow && stat(b->path, &st) == 0 &&
+        (st.st_size != b->size || st.st_mtime != b->mtime)) {
+        bufferEvict(b);
+    }
+
+    bool fresh = !b->loaded;
+    if (b->loaded) {
+        bufferUnstash(b);
+    } else if (editorMapFile(b->path) == 0) {
+        if (fstat(E.fd, &st) == 0) {
+            b->size = st.st_size;
+            b->mtime = st.st_mtime;
+        }
+        b->loaded = true;
+        B.nloaded++;
+        while (B.nloaded > BUFFER_MAX_LOADED) {
+            int lru = -1;
+            for (int i = 0; i < B.nbufs; i++) {
+                if (!B.bufs[i].loaded || B.bufs[i].pt || i == to) continue;
+                if (lru == -1 || B.bufs[i].lastViewed < B.bufs[lru].lastViewed) lru = i;
+            }
+            if (lru == -1) break; // Every other loaded buffer has unsaved edits
+            bufferEvict(&B.bufs[lru]);
+        }
+    } else if (first) {
+        die("open");
+    } else {
+        editorSetStatusMessage("Can't open %s: %s", b->path, strerror(errno));
+    }
+
+    E.cx = b->cx;
+    E.cy = b->cy;
+    E.rowoff = b->rowoff;
+    E.coloff = b->coloff;
+    free(E.filename);
+    E.filename = strdup(b->path);
+    if (E.filename == NULL) die("strdup");
+    E.version++;
+    editorClampCursor();
+    tableStart(b->table && b->loaded);
+    paneShareView();
+
+    if (E.follow && b->loaded) {
+        if (fresh) {
+            editorFollowStart();
+        } else {
+            editorFollowWatch();
+            editorFollowGrow(); // Catch up on what was appended while parked
+        }
+    }
+    if (B.nbufs > 1 && b->loaded) {
+        editorSetStatusMessage("[%d/%d] %s", to + 1, B.nbufs, b->path);
+    }
+}
+
+/*** Editing ***/
+
+/*
+ * Returns the document offset of the cursor held in E.
+ */
+static size_t editorCursorOffset(void) {
+    if (E.cy >= E.numrows) return E.docLen;
+    return editorRowStart(E.cy) + E.cx;
+}
+
+/*
+ * Converts a document offset to a cursor position. An offset past a
+ * final newline is on the empty row after the last one.
+ * Args:
+ *   off - Offset within the document, or E.docLen.
+ *   cy - Pointer to store the row.
+ *   cx - Pointer to store the byte offset within the row.
+ */
+static void editorOffsetToCursor(size_t off, long *cy, int *cx) {
+    if (off >= E.docLen && (E.docLen == 0 || *editorDocBytes(E.docLen - 1, 1) == '\n')) {
+        *cy = E.numrows;
+        *cx = 0;
+        return;
+    }
+    *cy = editorRowAtOffset(off);
+    *cx = off - editorRowStart(*cy);
+}
+
+/*
+ * Returns the offset one step from another, moving the way the arrow
+ * keys do: a grapheme cluster at a time within a row, and from the end
+ * of a row to the start of the next one.
+ * Args:
+ *   off - Offset within the document, or E.docLen.
+ *   dir - -1 to step back, 1 to step forward.
+ */
+static size_t editorStepOffset(size_t off, int dir) {
+    long cy;
+    int cx, len = 0, w;
+    editorOffsetToCursor(off, &cy, &cx);
+    const char *row = cy < E.numrows ? editorRowAt(cy, &len) : NULL;
+
+    if (dir < 0) {
+        if (cx > 0) return off - cx + editorPrevCluster(row, len, cx);
+        if (cy == 0) return off;
+        size_t start = editorRowStart(cy - 1);
+        editorRowAt(cy - 1, &len);
+        return start + len;
+    }
+    if (row && cx < len) return off - cx + editorClusterStep(row, len, cx, 0, &w);
+    if (cy + 1 < E.numrows) return editorRowStart(cy + 1);
+    return E.docLen;
+}
+
+/*
+ * Makes room for a number of extra cursors.
+ * Args:
+ *   n - Number of cursors.
+ */
+static void cursorReserve(size_t n) {
+    if (n <= C.cap) return;
+    size_t cap = C.cap ? C.cap : 64;
+    while (cap < n) cap *= 2;
+    C.offs = realloc(C.offs, cap * sizeof(size_t));
+    if (C.offs == NULL) die("realloc");
+    C.cap = cap;
+}
+
+/*
+ * Adds an offset to the extra cursors, unless one is already there.
+ * Args:
+ *   off - Document offset.
+ */
+static void cursorInsert(size_t off) {
+    size_t lo = 0, hi = C.n;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (C.offs[mid] < off) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo < C.n && C.offs[lo] == off) return;
+    cursorReserve(C.n + 1);
+    memmove(C.offs + lo + 1, C.offs + lo, (C.n - lo) * sizeof(size_t));
+    C.offs[lo] = off;
+    C.n++;
+}
+
+/*
+ * Sorts the extra cursors back into order after they moved, dropping
+ * the ones that landed on another cursor or on the one in E.
+ */
+static void cursorNormalize(void) {
+    size_t primary = editorCursorOffset(), n = 0;
+    for (size_t i = 0; i < C.n; i++) {
+        if (C.offs[i] == primary || (n && C.offs[n - 1] == C.offs[i])) continue;
+        C.offs[n++] = C.offs[i];
+    }
+    C.n = n;
+}
+
+/*
+ * Returns whether the document can be edited, starting a piece table
+ * over it on the first edit. Compressed and followed files are only
+ * viewed, and a buffer with no file open has nothing to edit.
+ */
+static bool editorEditable(void) {
+    if (E.pt) return true;
+    if (E.filename == NULL || E.fd == -1 || E.gz || E.follow) {
+        editorSetStatusMessage(E.gz ? "Compressed files are read-only" :
+                               E.follow ? "Read-only while following" : "No file to edit");
+        return false;
+    }
+    E.pt = pieceNew();
+    return true;
+}
+
+/*
+ * Returns where a row started before a batch of edits, counting the
+ * offset past a final newline as one more row.
+ * Args:
+ *   r - Row index, at most E.numrows.
+ *   oldLen - Document length before the batch.
+ */
+static size_t editorOldRowStart(long r, size_t oldLen) {
+    return r < E.numrows ? E.lineIdx[r] : oldLen;
+}
+
+/*
+ * Returns how many rows started at or before an offset before a batch
+ * of edits, counting the offset past a final newline as one more row.
+ * Args:
+ *   off - Offset as before the batch.
+ *   rows - Rows including that extra one.
+ *   oldLen - Document length before the batch.
+ */
+static long editorOldRowsThrough(size_t off, long rows, size_t oldLen) {
+    long lo = 0, hi = rows;
+    while (lo < hi) {
+        long mid = (lo + hi) / 2;
+        if (editorOldRowStart(mid, oldLen) <= off) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/*
+ * Updates a full line index for a batch of edits in one merge pass:
+ * rows before an edit keep their start, rows whose newline was deleted
+ * go, rows after it move by the size change so far, and every newline
+ * inserted starts a new row. An offset past a final newline is treated
+ * as one more row, so text typed there becomes a row of its own. Only
+ * the rows between the first and last edit are merged; the rest of the
+ * index is shifted in place.
+ * Args:
+ *   edits - The batch, as given to pieceApply.
+ *   n - Number of edits.
+ *   tail - Whether the document ended with a newline, or was empty.
+ *   oldLen - Document length before the batch.
+ *   newLen - Document length after it.
+ */
+static void editorIndexEdits(const struct edit *edits, size_t n, bool tail,
+                             size_t oldLen, size_t newLen) {
+    const char *add = E.pt->add;
+    size_t extra = 0;
+    for (size_t k = 0; k < n && add; k++) {
+        const char *s = add + edits[k].ins, *end = s + edits[k].insLen;
+        while ((s = memchr(s, '\n', end - s)) != NULL) {
+            extra++;
+            s++;
+        }
+    }
+
+    long rows = E.numrows + tail;
+    long first = editorOldRowsThrough(edits[0].off, rows, oldLen);
+    long last = editorOldRowsThrough(edits[n - 1].off + edits[n - 1].del, rows, oldLen);
+    size_t *mid = malloc((last - first + extra + 1) * sizeof(size_t));
+    if (mid == NULL) die("malloc");
+    size_t count = 0, delta = 0; // delta wraps when the document shrank
+    long r = first;
+    for (size_t k = 0; k < n; k++) {
+        const struct edit *e = &edits[k];
+        while (r < rows && editorOldRowStart(r, oldLen) <= e->off) mid[count++] = editorOldRowStart(r++, oldLen) + delta;
+
+        const char *s = add + e->ins, *end = s + e->insLen;
+        while (add && (s = memchr(s, '\n', end - s)) != NULL) {
+            s++;
+            mid[count++] = e->off + delta + (s - (add + e->ins));
+        }
+        while (r < rows && editorOldRowStart(r, oldLen) <= e->off + e->del) r++;
+        delta += e->insLen - e->del;
+    }
+
+    // The row past a final newline moves to the new end and is dropped
+    size_t after = last < E.numrows ? E.numrows - last : 0;
+    size_t total = first + count + after;
+    lineReserve(total);
+    memmove(E.lineIdx + first + count, E.lineIdx + last, after * sizeof(size_t));
+    for (size_t i = first + count; i < total; i++) E.lineIdx[i] += delta;
+    memcpy(E.lineIdx + first, mid, count * sizeof(size_t));
+    free(mid);
+
+    // A row can only start past the end after a final newline
+    while (total > 0 && E.lineIdx[total - 1] >= newLen) total--;
+    E.lineSlots = total;
+    E.numrows = total;
+}
+
+/*
+ * Updates a sparse line index for a batch of edits by scanning the rows
+ * again from the last entry before the first edit to the first entry
+ * after the last one. Later entries move by the change in size and row
+ * count; when that count is not a multiple of the stride, the index
+ * starts recording the row of each entry.
+ * Args:
+ *   edits - The batch, as given to pieceApply.
+ *   n - Number of edits.
+ *   newLen - Document length after it.
+ */
+static void editorIndexStrides(const struct edit *edits, size_t n, size_t newLen) {
+    size_t delta = 0;
+    for (size_t k = 0; k < n; k++) delta += edits[k].insLen - edits[k].del;
+
+    size_t slots = E.lineSlots, a = 0, b = 0;
+    if (slots) {
+        a = lineSlotOfOffset(edits[0].off);
+        b = lineSlotOfOffset(edits[n - 1].off + edits[n - 1].del) + 1;
+    }
+    size_t off = slots ? E.lineIdx[a] : 0;
+    long rowA = slots ? lineRowOf(a) : 0;
+    long rowB = b < slots ? lineRowOf(b) : E.numrows;
+    size_t stop = b < slots ? E.lineIdx[b] + delta : newLen;
+
+    long stride = 1L << M.indexShift, rows = 0;
+    size_t m = 0, cap = 16;
+    size_t *fresh = malloc(cap * sizeof(size_t));
+    if (fresh == NULL) die("malloc");
+    for (; off < stop; off = editorNextRow(off), rows++) {
+        if (rows % stride) continue;
+        if (m == cap) {
+            cap *= 2;
+            fresh = realloc(fresh, cap * sizeof(size_t));
+            if (fresh == NULL) die("realloc");
+        }
+        fresh[m++] = off;
+    }
+
+    long dRows = rowA + rows - rowB;
+    if (b < slots && dRows % stride) lineTrackRows();
+    size_t total = a + m + (slots - b);
+    lineReserve(total);
+    memmove(E.lineIdx + a + m, E.lineIdx + b, (slots - b) * sizeof(size_t));
+    memcpy(E.lineIdx + a, fresh, m * sizeof(size_t));
+    for (size_t i = a + m; i < total; i++) E.lineIdx[i] += delta;
+    if (E.lineRow) {
+        memmove(E.lineRow + a + m, E.lineRow + b, (slots - b) * sizeof(long));
+        for (size_t i = 0; i < m; i++) E.lineRow[a + i] = rowA + (long)i * stride;
+        for (size_t i = a + m; i < total; i++) E.lineRow[i] += dRows;
+    }
+    free(fresh);
+    E.lineSlots = total;
+    E.numrows += dRows;
+}
+
+/*
+ * Applies a batch of edits, one per cursor, as a single document
+ * operation: the piece table is rewritten in one pass and the line
+ * index is updated in one pass, however many cursors there are; a
+ * sparse index has only the strides the edits touch scanned again.
+ * The cursors move to the end of their edits, and any block selection
+ * is dropped.
+ * Args:
+ *   edits - One edit per cursor, sorted, offsets as before the batch.
+ *   n - Number of edits.
+ *   primary - Index of the edit made at the cursor held in E.
+ */
+static void editorApplyEdits(struct edit *edits, size_t n, size_t primary) {
+    // Cursors side by side may reach into each other's deletions
+    for (size_t k = 1; k < n; k++) {
+        size_t prevEnd = edits[k - 1].off + edits[k - 1].del;
+        if (edits[k].off < prevEnd) {
+            size_t cut = prevEnd - edits[k].off;
+            edits[k].del = edits[k].del > cut ? edits[k].del - cut : 0;
+            edits[k].off = prevEnd;
+        }
+    }
+
+    size_t oldLen = E.docLen;
+    bool tail = oldLen == 0 || *editorDocBytes(oldLen - 1, 1) == '\n';
+    foldSaveOffsets();
+
+    pieceApply(E.pt, edits, n);
+    E.docLen = E.pt->len;
+    M.scanRow = -1;
+    if (M.indexShift == 0) editorIndexEdits(edits, n, tail, oldLen, E.docLen);
+    else editorIndexStrides(edits, n, E.docLen);
+    foldApplyEdits(edits, n);
+    E.version++;
+    bracketApplyEdits(edits, n, oldLen);
+
+    size_t delta = 0, nextra = 0, primaryOff = 0;
+    for (size_t k = 0; k < n; k++) {
+        size_t off = edits[k].off + delta + edits[k].insLen;
+        delta += edits[k].insLen - edits[k].del;
+        if (k == primary) primaryOff = off;
+        else C.offs[nextra++] = off;
+    }
+    C.n = nextra;
+    C.block = false;
+    editorOffsetToCursor(primaryOff, &E.cy, &E.cx);
+    cursorNormalize();
+}
+
+/*
+ * Returns the edit one cursor makes.
+ * Args:
+ *   off - Offset of the cursor.
+ *   ins - Offset of the inserted bytes in the add buffer.
+ *   insLen - Number of inserted bytes.
+ *   del - Direction of the deletion: -1 the step before the cursor, 1
+ *         the step after it, 0 nothing.
+ */
+static struct edit editorEditAt(size_t off, size_t ins, size_t insLen, int del) {
+    size_t from = del < 0 ? editorStepOffset(off, -1) : off;
+    size_t to = del > 0 ? editorStepOffset(off, 1) : off;
+    return (struct edit){from, to - from, ins, insLen};
+}
+
+/*
+ * Makes the same edit at every cursor, as one batch.
+ * Args:
+ *   ins - Offset of the inserted bytes in the add buffer.
+ *   insLen - Number of inserted bytes, 0 to only delete.
+ *   del - Direction of the deletion, as for editorEditAt.
+ */
+static void editorEditCursors(size_t ins, size_t insLen, int del) {
+    size_t self = editorCursorOffset(), k = 0, primary = SIZE_MAX;
+    struct edit *edits = malloc((C.n + 1) * sizeof(struct edit));
+    if (edits == NULL) die("malloc");
+
+    // Merge the cursor in E into the sorted extra ones
+    for (size_t j = 0; j <= C.n; j++) {
+        if (primary == SIZE_MAX && (j == C.n || self < C.offs[j])) {
+            primary = k;
+            edits[k++] = editorEditAt(self, ins, insLen, del);
+        }
+        if (j < C.n) edits[k++] = editorEditAt(C.offs[j], ins, insLen, del);
+    }
+    editorApplyEdits(edits, k, primary);
+    free(edits);
+}
+
+/*
+ * Returns the display column of the cursor in E. E.rx is only brought
+ * up to date when a frame is drawn.
+ */
+static int editorCursorRx(void) {
+    int len;
+    if (E.cy >= E.numrows) return 0;
+    const char *row = editorRowAt(E.cy, &len);
+    return editorCxToRx(row, len, E.cx);
+}
+
+/*
+ * Replaces the columns of the block selection with text on every row
+ * it spans, as one batch. Only the rows of the block are looked up,
+ * through the line index, so the cost does not depend on the rest of
+ * the document. A cursor is left after the text on each row.
+ * Args:
+ *   text - Text to insert on each row, NULL to only delete.
+ *   len - Length of text.
+ *   widen - For an empty block, -1 deletes the column before it and 1
+ *           the column after it (Backspace and Delete); 0 otherwise.
+ */
+static void editorBlockEdit(const char *text, size_t len, int widen) {
+    long r0, r1;
+    int c0, c1;
+    editorBlockBounds(editorCursorRx(), &r0, &r1, &c0, &c1);
+    if (r1 < r0 || !editorEditable()) return;
+    if (c0 == c1 && widen < 0 && c0 > 0) c0--;
+    if (c0 == c1 && widen > 0) c1++;
+
+    size_t n = r1 - r0 + 1, ins = len ? pieceAppend(E.pt, text, len) : 0;
+    long primary = (E.cy < r1 ? E.cy : r1) - r0;
+    struct edit *edits = malloc(n * sizeof(struct edit));
+    if (edits == NULL) die("malloc");
+    for (long r = r0; r <= r1; r++) {
+        size_t start = editorRowStart(r);
+        int rowLen;
+        const char *row = editorRowAt(r, &rowLen);
+        int x0 = editorRxToCx(row, rowLen, c0);
+        int x1 = editorRxToCx(row, rowLen, c1);
+        edits[r - r0] = (struct edit){start + x0, x1 - x0, ins, len};
+    }
+    cursorReserve(n);
+    editorApplyEdits(edits, n, primary);
+    free(edits);
+}
+
+/*
+ * Copies the block selection, one line per row it spans.
+ */
+static void editorBlockCopy(void) {
+    long r0, r1;
+    int c0, c1;
+    editorBlockBounds(editorCursorRx(), &r0, &r1, &c0, &c1);
+    C.clipLen = 0;
+    for (long r = r0; r <= r1; r++) {
+        int rowLen;
+        const char *row = editorRowAt(r, &rowLen);
+        int x0 = editorRxToCx(row, rowLen, c0);
+        int x1 = editorRxToCx(row, rowLen, c1);
+        if (C.clipLen + (x1 - x0) + 1 > C.clipCap) {
+            C.clipCap = (C.clipLen + (x1 - x0) + 1) * 2;
+            C.clip = realloc(C.clip, C.clipCap);
+            if (C.clip == NULL) die("realloc");
+        }
+        memcpy(C.clip + C.clipLen, row + x0, x1 - x0);
+        C.clipLen += x1 - x0;
+        if (r < r1) C.clip[C.clipLen++] = '\n';
+    }
+    C.block = false;
+    editorSetStatusMessage("Copied %ld rows of %d columns", r1 - r0 + 1, c1 - c0);
+}
+
+/*
+ * Pastes the copied block at the cursor: its first line goes on the
+ * cursor's row, the next below it and so on, all at the cursor's display
+ * column, as one batch. Rows too short to reach the column are padded
+ * with spaces. Lines beyond the last row are dropped.
+ */
+static void editorBlockPaste(void) {
+    if (C.clip == NULL || !editorEditable()) return;
+    int rx = editorCursorRx();
+    long r0 = E.cy;
+    size_t n = 0;
+    for (const char *p = C.clip; p && r0 + (long)n < E.numrows; n++) {
+        p = memchr(p, '\n', C.clip + C.clipLen - p);
+        if (p) p++;
+    }
+    if (n == 0) return;
+
+    struct edit *edits = malloc(n * sizeof(struct edit));
+    char *line = NULL;
+    size_t lineCap = 0;
+    if (edits == NULL) die("malloc");
+    const char *p = C.clip, *end = C.clip + C.clipLen;
+    for (size_t k = 0; k < n; k++) {
+        const char *nl = memchr(p, '\n', end - p);
+        size_t textLen = (nl ? nl : end) - p;
+        size_t start = editorRowStart(r0 + k);
+        int rowLen;
+        const char *row = editorRowAt(r0 + k, &rowLen);
+        int x = editorRxToCx(row, rowLen, rx);
+        int pad = G.on ? 0 : rx - editorRowCxToRx(row, rowLen, x); // Fields are padded on screen
+        if (pad < 0) pad = 0; // The column is inside a wide character
+
+        if (pad + textLen > lineCap) {
+            lineCap = pad + textLen;
+            line = realloc(line, lineCap);
+            if (line == NULL) die("realloc");
+        }
+        memset(line, ' ', pad);
+        memcpy(line + pad, p, textLen);
+        edits[k] = (struct edit){start + x, 0, pieceAppend(E.pt, line, pad + textLen),
+                                 pad + textLen};
+        p = nl ? nl + 1 : end;
+    }
+    C.n = 0;
+    cursorReserve(n);
+    editorApplyEdits(edits, n, 0);
+    free(edits);
+    free(line);
+}
+
+/*
+ * Inserts text at every cursor.
+ * Args:
+ *   s - The text.
+ *   len - Its length.
+ */
+static void editorInsertText(const char *s, size_t len) {
+    if (!editorEditable()) return;
+    editorEditCursors(pieceAppend(E.pt, s, len), len, 0);
+}
+
+/*
+ * Deletes a grapheme cluster, or a line break, at every cursor, or the
+ * columns of the block selection.
+ * Args:
+ *   dir - -1 for the one before the cursor (Backspace), 1 for the one
+ *         after it (Delete).
+ */
+static void editorDeleteChar(int dir) {
+    if (C.block) {
+        editorBlockEdit(NULL, 0, dir);
+        return;
+    }
+    if (!editorEditable()) return;
+    editorEditCursors(0, 0, dir);
+}
+
+/*
+ * Queues a typed byte. Typed bytes are inserted together when another
+ * key arrives or a frame is drawn, so a paste or a burst of typing costs
+ * one edit rather than one per byte.
+ * Args:
+ *   c - The byte.
+ */
+static void editorTypeChar(char c) {
+    if (C.typedLen == C.typedCap) {
+        C.typedCap = C.typedCap ? C.typedCap * 2 : 256;
+        C.typed = realloc(C.typed, C.typedCap);
+        if (C.typed == NULL) die("realloc");
+    }
+    C.typed[C.typedLen++] = c;
+}
+
+/*
+ * Inserts the queued typed bytes at every cursor, or in place of the
+ * block selection on every row it spans.
+ */
+static void editorFlushTyped(void) {
+    if (C.typedLen == 0) return;
+    if (C.block) editorBlockEdit(C.typed, C.typedLen, 0);
+    else editorInsertText(C.typed, C.typedLen);
+    C.typedLen = 0;
+}
+
+/*
+ * Returns whether any buffer has edits that were not saved.
+ */
+static bool editorUnsaved(void) {
+    if (E.pt) return true;
+    for (int i = 0; i < B.nbufs; i++) {
+        if (i != B.current && B.bufs[i].pt) return true;
+    }
+    return false;
+}
+
+/*
+ * Writes the edited document to a temporary file next to the original
+ * and renames it over the original. The new file is then mapped in place
+ * of the old one; its rows are where the line index already has them,
+ * so nothing is indexed again.
+ */
+static void editorSave(void) {
+    if (E.pt == NULL) {
+        editorSetStatusMessage("No changes to save");
+        return;
+    }
+
+    char tmp[PATH_MAX];
+    struct stat st;
+    if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", E.filename) >= (int)sizeof(tmp)) {
+        errno = ENAMETOOLONG;
+        editorSetStatusMessage("Can't save: %s", strerror(errno));
+        return;
+    }
+    int fd = mkstemp(tmp);
+    if (fd == -1) {
+        editorSetStatusMessage("Can't save: %s", strerror(errno));
+        return;
+    }
+    if (fstat(E.fd, &st) == 0) fchmod(fd, st.st_mode & 07777);
+
+    // Small pieces are gathered into one write per granule
+    bool ok = true;
+    for (size_t off = 0; off < E.pt->len && ok;) {
+        size_t n = E.pt->len - off < RESIDENT_GRANULE ? E.pt->len - off : RESIDENT_GRANULE;
+        const char *bytes = pieceBytes(E.pt, off, n);
+        for (size_t done = 0; done < n && ok;) {
+            ssize_t w = write(fd, bytes + done, n - done);
+            if (w > 0) done += w;
+            else ok = w == -1 && errno == EINTR;
+        }
+        off += n;
+    }
+    if (!ok || fsync(fd) == -1 || rename(tmp, E.filename) == -1) {
+        editorSetStatusMessage("Can't save: %s", strerror(errno));
+        close(fd);
+        unlink(tmp);
+        return;
+    }
+
+    size_t len = E.pt->len;
+    char *map = NULL;
+    if (len > 0) {
+        map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) die("mmap");
+    }
+    if (E.map) munmap(E.map, E.mapLen);
+    close(E.fd);
+    pieceFree(E.pt);
+    E.pt = NULL;
+    E.map = map;
+    E.mapLen = len;
+    E.fd = fd;
+    M.nresident = 0; // The granules were pages of the old mapping
+    M.lastGranule = SIZE_MAX;
+    if (fstat(fd, &st) == 0) {
+        B.bufs[B.current].size = st.st_size;
+        B.bufs[B.current].mtime = st.st_mtime;
+    }
+    editorSetStatusMessage("%zu bytes written to %s", len, E.filename);
+}
+
+/*** Word Motion ***/
+
+static unsigned char wordClasses[256];
+
+/*
+ * Fills the class table word motion looks bytes up in: whitespace and
+ * control bytes, letters, digits, underscores and every byte of a
+ * multi-byte character, and punctuation.
+ */
+static void initWordClasses(void) {
+    for (int c = 0; c < 256; c++) {
+        if (c <= ' ') wordClasses[c] = WORD_SPACE;
+        else if (isalnum(c) || c == '_' || c >= 0x80) wordClasses[c] = WORD_WORD;
+        else wordClasses[c] = WORD_PUNCT;
+    }
+}
+
+/*
+ * Classifies WORD_BLOCK bytes the way the class table does, one mask
+ * bit per byte.
+ * Args:
+ *   p - The bytes.
+ *   cls - Class to look for.
+ * Returns:
+ *   The bytes of that class.
+ */
+static uint32_t wordClassify(const char *p, int cls) {
+    uint32_t space = 0, word = 0;
+#if defined(__SSE2__)
+    for (int k = 0; k < WORD_BLOCK; k += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + k));
+        __m128i high = _mm_cmplt_epi8(v, _mm_setzero_si128()); // Bytes of 0x80 and up
+        __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+        __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                                      _mm_cmplt_epi8(lower, _mm_set1_epi8('z' + 1)));
+        __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+                                      _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+        __m128i w = _mm_or_si128(_mm_or_si128(high, alpha),
+                                 _mm_or_si128(digit, _mm_cmpeq_epi8(v, _mm_set1_epi8('_'))));
+        __m128i s = _mm_andnot_si128(high, _mm_cmplt_epi8(v, _mm_set1_epi8(' ' + 1)));
+        space |= (uint32_t)_mm_movemask_epi8(s) << k;
+        word |= (uint32_t)_mm_movemask_epi8(w) << k;
+    }
+#else
+    for (int k = 0; k < WORD_BLOCK; k++) {
+        int c = wordClasses[(unsigned char)p[k]];
+        if (c == WORD_SPACE) space |= 1u << k;
+        if (c == WORD_WORD) word |= 1u << k;
+    }
+#endif
+    if (cls == WORD_SPACE) return space;
+    if (cls == WORD_WORD) return word;
+    return ~(space | word);
+}
+
+/*
+ * Skips a run of bytes of one class.
+ * Args:
+ *   off - Offset to start at.
+ *   cls - Class of the run.
+ *   dir - -1 to skip the bytes before off, 1 those from off on.
+ * Returns:
+ *   Offset of the first byte past the run in that direction, or of the
+ *   byte after the last one before it going back.
+ */
+static size_t wordSkip(size_t off, int cls, int dir) {
+    if (dir > 0) {
+        while (off < E.docLen) {
+            size_t n = E.docLen - off < SCAN_CHUNK ? E.docLen - off : SCAN_CHUNK;
+            if (E.pt) n = pieceRun(E.pt, off, n);
+            const char *p = editorDocBytes(off, n);
+            size_t i = 0;
+            for (; i + WORD_BLOCK <= n; i += WORD_BLOCK) {
+                uint32_t other = ~wordClassify(p + i, cls);
+                if (other) return off + i + __builtin_ctz(other);
+            }
+            for (; i < n; i++) {
+                if (wordClasses[(unsigned char)p[i]] != cls) return off + i;
+            }
+            off += n;
+        }
+        return off;
+    }
+    while (off > 0) {
+        size_t n = off < SCAN_CHUNK ? off : SCAN_CHUNK;
+        const char *p = editorDocBytes(off - n, n);
+        size_t i = n;
+        for (; i >= WORD_BLOCK; i -= WORD_BLOCK) {
+            uint32_t other = ~wordClassify(p + i - WORD_BLOCK, cls);
+            if (other) return off - n + i - __builtin_clz(other);
+        }
+        for (; i > 0; i--) {
+            if (wordClasses[(unsigned char)p[i - 1]] != cls) return off - n + i;
+        }
+        off -= n;
+    }
+    return 0;
+}
+
+/*
+ * Returns the offset a word motion reaches: past any whitespace, then
+ * past the word or the run of punctuation after it. Newlines count as
+ * whitespace, so the motion carries on across rows.
+ * Args:
+ *   off - Offset within the document, or E.docLen.
+ *   dir - -1 for the start of the word before, 1 for the end of the one
+ *         after.
+ */
+static size_t wordOffset(size_t off, int dir) {
+    off = wordSkip(off, WORD_SPACE, dir);
+    if (dir > 0 && off < E.docLen) {
+        return wordSkip(off, wordClasses[(unsigned char)*editorDocBytes(off, 1)], 1);
+    }
+    if (dir < 0 && off > 0) {
+        return wordSkip(off, wordClasses[(unsigned char)*editorDocBytes(off - 1, 1)], -1);
+    }
+    return off;
+}
+
+/*** JSON Navigation ***/
+
+/*
+ * Classifies JSON_BLOCK bytes, one mask bit per byte.
+ * Args:
+ *   p - The bytes.
+ *   bs - Pointer to store the backslashes.
+ *   quote - Pointer to store the double quotes.
+ *   op - Pointer to store the brackets and commas.
+ */
+static void jsonClassify(const char *p, uint64_t *bs, uint64_t *quote, uint64_t *op) {
+    *bs = *quote = *op = 0;
+#if defined(__SSE2__)
+    for (int k = 0; k < JSON_BLOCK; k += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + k));
+        __m128i braces = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('{')),
+                                      _mm_cmpeq_epi8(v, _mm_set1_epi8('}')));
+        __m128i brackets = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('[')),
+                                        _mm_cmpeq_epi8(v, _mm_set1_epi8(']')));
+        __m128i ops = _mm_or_si128(_mm_or_si128(braces, brackets),
+                                   _mm_cmpeq_epi8(v, _mm_set1_epi8(',')));
+        *bs |= (uint64_t)(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))) << k;
+        *quote |= (uint64_t)(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('"'))) << k;
+        *op |= (uint64_t)(unsigned)_mm_movemask_epi8(ops) << k;
+    }
+#else
+    for (int k = 0; k < JSON_BLOCK; k++) {
+        char c = p[k];
+        if (c == '\\') *bs |= 1ULL << k;
+        if (c == '"') *quote |= 1ULL << k;
+        if (c == '{' || c == '}' || c == '[' || c == ']' || c == ',') *op |= 1ULL << k;
+    }
+#endif
+}
+
+/*
+ * Finds the bytes escaped by a backslash: those after a run of an odd
+ * number of them. Adding a run's start bit to the run carries it to the
+ * byte after the run, and an odd length shows as a start and an end of
+ * different parity.
+ * Args:
+ *   bs - The backslashes of a block.
+ * Returns:
+ *   The escaped bytes of the block; J.escaped carries into the next.
+ */
+static uint64_t jsonEscaped(uint64_t bs) {
+    const uint64_t even = 0x5555555555555555ULL, odd = ~even;
+    uint64_t starts = bs & ~(bs << 1);
+    uint64_t evenMask = even ^ J.escaped; // A run going on from the last block starts odd
+    uint64_t evenCarries = bs + (starts & evenMask);
+    uint64_t oddCarries = bs + (starts & ~evenMask);
+    uint64_t carry = oddCarries < bs; // An odd run reaches the end of the block
+    oddCarries |= J.escaped;
+    J.escaped = carry;
+    return (evenCarries & ~bs & odd) | (oddCarries & ~bs & even);
+}
+
+/*
+ * Records a bracket or a comma found outside strings, pairing brackets
+ * through a stack of the open ones. Only every JSON_COMMA_STRIDE-th
+ * comma of a container is kept, enough to count elements from.
+ * Args:
+ *   off - Offset of the byte.
+ *   c - The byte.
+ */
+static void jsonAddMark(size_t off, char c) {
+    uint32_t top = J.depth ? J.stack[J.depth - 1] : JSON_NONE;
+    struct jsonMark m = {off, JSON_NONE, top, J.depth ? J.commas[J.depth - 1] : 0, c};
+    if (c == ',') {
+        if (top == JSON_NONE || ++J.commas[J.depth - 1] % JSON_COMMA_STRIDE) return;
+        m.ordinal = J.commas[J.depth - 1];
+    } else if (c == '}' || c == ']') {
+        if (top != JSON_NONE) {
+            J.depth--;
+            m = J.marks[top];
+            m.off = off;
+            m.c = c;
+            m.match = top;
+            J.marks[top].match = J.n;
+        }
+    }
+    if (J.n == JSON_NONE) return; // Past what an index can count
+    if (J.n == J.cap) {
+        J.cap = J.cap ? J.cap * 2 : 4096;
+        J.marks = realloc(J.marks, J.cap * sizeof(struct jsonMark));
+        if (J.marks == NULL) die("realloc");
+    }
+    if (c == '{' || c == '[') {
+        if (J.depth == J.stackCap) {
+            J.stackCap = J.stackCap ? J.stackCap * 2 : 64;
+            J.stack = realloc(J.stack, J.stackCap * sizeof(uint32_t));
+            J.commas = realloc(J.commas, J.stackCap * sizeof(uint32_t));
+            if (J.stack == NULL || J.commas == NULL) die("realloc");
+        }
+        J.stack[J.depth] = J.n;
+        J.commas[J.depth++] = 0;
+    }
+    J.marks[J.n++] = m;
+}
+
+/*
+ * Runs the structural scan over one block: quotes that are not escaped
+ * toggle the string state, found for all bytes at once as a prefix XOR,
+ * and the brackets and commas outside strings are recorded.
+ * Args:
+ *   p - JSON_BLOCK bytes.
+ *   off - Document offset of the first byte.
+ */
+static void jsonScanBlock(const char *p, size_t off) {
+    uint64_t bs, quote, op;
+    jsonClassify(p, &bs, &quote, &op);
+    if (bs | J.escaped) quote &= ~jsonEscaped(bs);
+
+    uint64_t in = quote;
+    for (int k = 1; k < JSON_BLOCK; k <<= 1) in ^= in << k;
+    in ^= J.inString;
+    J.inString = (uint64_t)0 - (in >> (JSON_BLOCK - 1));
+
+    for (op &= ~in; op; op &= op - 1) {
+        int k = __builtin_ctzll(op);
+        jsonAddMark(off + k, p[k]);
+    }
+}
+
+/*
+ * Builds the structural index of the document in one pass, unless the
+ * one built last is still current. Runs on the first JSON command and
+ * after the document changed, never while just moving around.
+ */
+static void jsonIndexBuild(void) {
+    if (J.built && J.version == E.version && J.len == E.docLen) return;
+    J.n = 0;
+    J.depth = 0;
+    J.inString = J.escaped = 0;
+
+    char block[JSON_BLOCK];
+    size_t off = 0, blockOff = 0;
+    int have = 0;
+    while (off < E.docLen) {
+        size_t n = E.docLen - off < SCAN_CHUNK ? E.docLen - off : SCAN_CHUNK;
+        if (E.pt) n = pieceRun(E.pt, off, n);
+        const char *p = editorDocBytes(off, n);
+        size_t i = 0;
+        if (have) { // Finish the block cut by the end of the last chunk
+            i = n < (size_t)(JSON_BLOCK - have) ? n : (size_t)(JSON_BLOCK - have);
+            memcpy(block + have, p, i);
+            have += i;
+            if (have == JSON_BLOCK) {
+                jsonScanBlock(block, blockOff);
+                have = 0;
+            }
+        }
+        for (; i + JSON_BLOCK <= n; i += JSON_BLOCK) jsonScanBlock(p + i, off + i);
+        if (i < n) {
+            memcpy(block + have, p + i, n - i);
+            if (have == 0) blockOff = off + i;
+            have += n - i;
+        }
+        off += n;
+    }
+    if (have) {
+        memset(block + have, ' ', JSON_BLOCK - have);
+        jsonScanBlock(block, blockOff);
+    }
+    J.built = true;
+    J.version = E.version;
+    J.len = E.docLen;
+}
+
+/*
+ * Returns the number of marks before an offset, by binary search.
+ */
+static uint32_t jsonMarksBefore(size_t off) {
+    uint32_t lo = 0, hi = J.n;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (J.marks[mid].off < off) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/*
+ * Counts the commas between two offsets that are outside strings. The
+ * range starts outside a string and holds no brackets.
+ * Args:
+ *   from, to - The range.
+ *   last - Pointer to store the offset of the last comma, if any.
+ */
+static uint32_t jsonCountCommas(size_t from, size_t to, size_t *last) {
+    uint32_t n = 0;
+    bool quoted = false, escaped = false;
+    while (from < to) {
+        size_t len = to - from < SCAN_CHUNK ? to - from : SCAN_CHUNK;
+        if (E.pt) len = pieceRun(E.pt, from, len);
+        const char *p = editorDocBytes(from, len);
+        for (size_t i = 0; i < len; i++) {
+            if (escaped) escaped = false;
+            else if (p[i] == '\\') escaped = true;
+            else if (p[i] == '"') quoted = !quoted;
+            else if (p[i] == ',' && !quoted) {
+                n++;
+                *last = from + i;
+            }
+        }
+        from += len;
+    }
+    return n;
+}
+
+/*
+ * Formats a member's key as a path component: .key when it is a plain
+ * name, ["key"] otherwise. Long keys are cut.
+ */
+static void jsonKeyComponent(const char *key, size_t len, char *out, size_t cap) {
+    bool plain = len > 0;
+    for (size_t i = 0; i < len; i++) {
+        if (!isalnum((unsigned char)key[i]) && key[i] != '_') plain = false;
+    }
+    int shown = len < JSON_KEY_MAX ? len : JSON_KEY_MAX;
+    const char *more = len > JSON_KEY_MAX ? "..." : "";
+    if (plain) snprintf(out, cap, ".%.*s%s", shown, key, more);
+    else snprintf(out, cap, "[\"%.*s%s\"]", shown, key, more);
+    for (char *c = out; *c; c++) if ((unsigned char)*c < 0x20) *c = '?';
+}
+
+/*
+ * Reads the key of the member starting at an offset: the first string
+ * after it.
+ * Args:
+ *   off - Offset just past the comma or brace before the member.
+ *   out - Buffer receiving the path component.
+ *   cap - Size of out.
+ */
+static void jsonKeyAfter(size_t off, char *out, size_t cap) {
+    size_t len = E.docLen - off < JSON_KEY_SCAN ? E.docLen - off : JSON_KEY_SCAN;
+    const char *p = editorDocBytes(off, len);
+    size_t i = 0;
+    while (i < len && isspace((unsigned char)p[i])) i++;
+    if (i < len && p[i] == '"') {
+        size_t start = ++i;
+        while (i < len && p[i] != '"') i += p[i] == '\\' ? 2 : 1;
+        if (i <= len) {
+            jsonKeyComponent(p + start, (i < len ? i : len) - start, out, cap);
+            return;
+        }
+    }
+    snprintf(out, cap, ".?");
+}
+
+/*
+ * Reads the key of the member whose value starts at an offset, found
+ * by stepping back over the colon before the value.
+ * Args:
+ *   off - Offset of the value's opening bracket.
+ *   out - Buffer receiving the path component.
+ *   cap - Size of out.
+ */
+static void jsonKeyBefore(size_t off, char *out, size_t cap) {
+    size_t from = off > JSON_KEY_SCAN ? off - JSON_KEY_SCAN : 0;
+    const char *p = editorDocBytes(from, off - from);
+    long i = off - from - 1;
+    while (i >= 0 && isspace((unsigned char)p[i])) i--;
+    if (i >= 0 && p[i] == ':') i--;
+    while (i >= 0 && isspace((unsigned char)p[i])) i--;
+    if (i >= 0 && p[i] == '"') {
+        long end = i--;
+        while (i >= 0) {
+            long k = i;
+            while (k > 0 && p[k - 1] == '\\') k--;
+            if (p[i] == '"' && (i - k) % 2 == 0) break; // Not escaped
+            i--;
+        }
+        if (i >= 0) {
+            jsonKeyComponent(p + i + 1, end - i - 1, out, cap);
+            return;
+        }
+    }
+    snprintf(out, cap, ".?");
+}
+
+/*
+ * Describes where an offset is in the document as a path of keys and
+ * array indexes, such as $.items[1042].name. The container around the
+ * offset is found by binary search; each level above it comes from its
+ * opening bracket's parent link, so the cost does not depend on the
+ * size of the document or of the arrays on the way.
+ * Args:
+ *   off - Offset within the document.
+ *   out - Buffer receiving the path.
+ *   cap - Size of out.
+ */
+static void jsonPath(size_t off, char *out, size_t cap) {
+    char comps[JSON_PATH_MAX][JSON_KEY_MAX + 16];
+    int n = 0;
+    bool cut = false;
+    uint32_t k = jsonMarksBefore(off);
+    const struct jsonMark *m = k ? &J.marks[k - 1] : NULL;
+
+    // The container holding off, and what precedes off inside it
+    uint32_t c = JSON_NONE, base = 0;
+    bool on = k < J.n && J.marks[k].off == off && J.marks[k].c != ',';
+    if (on) {
+        // On a bracket: the path of the object or array it delimits
+        c = J.marks[k].c == '{' || J.marks[k].c == '[' ? k : J.marks[k].match;
+    } else if (m && (m->c == '{' || m->c == '[')) {
+        c = k - 1;
+    } else if (m) {
+        c = m->parent;
+        base = m->ordinal;
+    }
+    if (c != JSON_NONE && !on) {
+        size_t last = 0;
+        uint32_t commas = jsonCountCommas(m->off + 1, off, &last);
+        if (J.marks[c].c == '[') {
+            snprintf(comps[n++], sizeof(comps[0]), "[%u]", base + commas);
+        } else if (commas || m->c == '{' || m->c == ',') {
+            jsonKeyAfter(commas ? last + 1 : m->off + 1, comps[n++], sizeof(comps[0]));
+        } else if (m->match != JSON_NONE) {
+            // Still in the member whose value just closed
+            jsonKeyBefore(J.marks[m->match].off, comps[n++], sizeof(comps[0]));
+        }
+    }
+    for (; c != JSON_NONE && J.marks[c].parent != JSON_NONE; c = J.marks[c].parent) {
+        if (n == JSON_PATH_MAX) {
+            cut = true;
+            break;
+        }
+        const struct jsonMark *o = &J.marks[c];
+        if (J.marks[o->parent].c == '[') snprintf(comps[n++], sizeof(comps[0]), "[%u]", o->ordinal);
+        else jsonKeyBefore(o->off, comps[n++], sizeof(comps[0]));
+    }
+
+    // Keep the innermost levels that fit
+    size_t len = 1;
+    int first = 0, used;
+    for (int i = 0; i < n; i++) {
+        if (len + strlen(comps[i]) + 3 >= cap) {
+            cut = true;
+            break;
+        }
+        len += strlen(comps[i]);
+        first = i + 1;
+    }
+    used = snprintf(out, cap, "%s", cut ? "..." : "$");
+    for (int i = first - 1; i >= 0; i--) {
+        used += snprintf(out + used, cap - used, "%s", comps[i]);
+    }
+}
+
+/*
+ * Shows the path to the cursor in the message bar.
+ */
+static void editorJsonShowPath(void) {
+    if (E.numrows == 0) return;
+    jsonIndexBuild();
+    char path[sizeof(E.statusmsg)];
+    jsonPath(editorCursorOffset(), path, sizeof(path));
+    editorSetStatusMessage("%s", path);
+}
+
+/*
+ * Moves the cursor to the bracket matching the one under or just before
+ * it, found through the bracket tree. Elsewhere it moves to the opening
+ * bracket of the enclosing JSON object or array and shows its path.
+ */
+static void editorJsonJump(void) {
+    if (E.numrows == 0) return;
+    size_t off = editorCursorOffset(), at = bracketAt(off);
+    if (at != SIZE_MAX) {
+        bracketReady(true);
+        size_t match = bracketMatch(at);
+        if (match == SIZE_MAX) editorSetStatusMessage("No matching bracket");
+        else editorOffsetToCursor(match, &E.cy, &E.cx);
+        return;
+    }
+
+    jsonIndexBuild();
+    uint32_t k = jsonMarksBefore(off), target = JSON_NONE;
+    const struct jsonMark *m;
+
+    if (k) {
+        m = &J.marks[k - 1];
+        target = m->c == '{' || m->c == '[' ? k - 1 : m->parent;
+    }
+    if (target == JSON_NONE) {
+        editorSetStatusMessage("No matching bracket");
+        return;
+    }
+    editorOffsetToCursor(J.marks[target].off, &E.cy, &E.cx);
+    editorJsonShowPath();
+}
+
+/*** Input Functions ***/
+
+/*
+ * Moves the cursor a number of rows up or down in one step, landing on
+ * the cluster covering the same display column.
+ * Args:
+ *   n - Rows to move, negative for up.
+ */
+static void editorMoveRows(long n) {
+    long target = foldRowToVisual(E.cy) + n;
+    if (target < 0) target = 0;
+    if (target > foldRowToVisual(E.numrows)) target = foldRowToVisual(E.numrows);
+    target = foldVisualToRow(target);
+    if (target == E.cy) return;
+
+    int len = 0;
+    const char *row = E.cy < E.numrows ? editorRowAt(E.cy, &len) : NULL;
+    int rx = row ? editorCxToRx(row, len, E.cx) : 0;
+    E.cy = target;
+    row = E.cy < E.numrows ? editorRowAt(E.cy, &len) : NULL;
+    E.cx = row ? editorRxToCx(row, len, rx) : 0;
+}
+
+/*
+ * Puts the cursor on a row and scrolls it to the top of the screen,
+ * without visiting the rows in between.
+ * Args:
+ *   row - Row index, clamped to the document.
+ *   cx - Byte offset within the row, clamped to the row.
+ */
+static void editorJumpTo(long row, int cx) {
+    int len = 0;
+    if (row > E.numrows - 1) row = E.numrows - 1;
+    if (row < 0) row = 0;
+    E.cy = row;
+    E.rowoff = row;
+    const char *r = E.cy < E.numrows ? editorRowAt(E.cy, &len) : NULL;
+
+    // An offset inside a cluster lands on the cluster's start
+    int i = 0, w;
+    while (r && i < cx && i < len) {
+        int next = editorClusterStep(r, len, i, 0, &w);
+        if (next > cx) break;
+        i = next;
+    }
+    E.cx = i;
+}
+
+/*
+ * Opens a prompt in the message bar. Keys go to the prompt until Enter
+ * or Escape, so it works the same when keys are replayed.
+ * Args:
+ *   label - Prompt format; %s is replaced with the input.
+ *   done - Called with the input when Enter is pressed.
+ */
+static void editorPromptStart(const char *label, void (*done)(const char *input)) {
+    E.promptLabel = label;
+    E.promptDone = done;
+    E.promptLen = 0;
+    E.promptBuf[0] = '\0';
+}
+
+/*
+ * Edits the open prompt with a key.
+ * Args:
+ *   c - The key.
+ */
+static void editorPromptKey(int c) {
+    if (c == '\x1b' || c == CTRL_KEY('c')) {
+        E.promptLabel = NULL;
+        editorSetStatusMessage("");
+    } else if (c == BACKSPACE || c == CTRL_KEY('h') || c == DEL_KEY) {
+        if (E.promptLen > 0) E.promptBuf[--E.promptLen] = '\0';
+    } else if (c == '\r') {
+        if (E.promptLen == 0) return;
+        E.promptLabel = NULL;
+        E.promptDone(E.promptBuf);
+    } else if (c >= ' ' && c < 0x7f && E.promptLen < PROMPT_MAX - 1) {
+        E.promptBuf[E.promptLen++] = c;
+        E.promptBuf[E.promptLen] = '\0';
+    }
+}
+
+/*
+ * Jumps to the position typed at the goto prompt: a line number, a
+ * percentage of the lines, or @ and a byte offset (decimal or 0x hex).
+ * All three are resolved through the line index.
+ * Args:
+ *   input - The text typed at the prompt.
+ */
+static void editorGotoDone(const char *input) {
+    char *end;
+    errno = 0;
+    if (input[0] == '@') {
+        unsigned long long off = strtoull(input + 1, &end, 0);
+        if (end != input + 1 && *end == '\0' && errno == 0) {
+            long row = editorRowAtOffset(off);
+            size_t start = E.numrows ? editorRowStart(row) : 0;
+            editorJumpTo(row, off > start ? (off - start > INT_MAX ? INT_MAX : off - start) : 0);
+            return;
+        }
+    } else {
+        double pct = strtod(input, &end);
+        if (end != input && *end == '%' && end[1] == '\0' && pct >= 0) {
+            editorJumpTo((long)((E.numrows - 1) * (pct > 100 ? 100 : pct) / 100), 0);
+            return;
+        }
+        unsigned long long line = strtoull(input, &end, 10);
+        if (end != input && *end == '\0' && errno == 0) {
+            editorJumpTo(line > (unsigned long long)E.numrows ? E.numrows - 1 : (long)line - 1, 0);
+            return;
+        }
+    }
+    editorSetStatusMessage("Not a line, percentage or @offset: %s", input);
+}
+
+/*
+ * Moves the cursor based on the given key. Horizontal moves step over whole
+ * grapheme clusters, or whole words with Ctrl; vertical moves keep the
+ * display column. A shifted arrow starts or grows the block selection, a
+ * plain one drops it.
+ * Args:
+ *   key - The key code (e.g., ARROW_LEFT) to process.
+ */
+static void editorMoveCursor(int key) {
+    int len = 0, w;
+
+    // Shifted arrows grow a block selection from where the cursor was
+    static const int plain[] = {ARROW_UP, ARROW_DOWN, ARROW_RIGHT, ARROW_LEFT};
+    if ((key >= SHIFT_ARROW_UP && key <= SHIFT_ARROW_LEFT) || key == CTRL_SHIFT_ARROW_RIGHT ||
+        key == CTRL_SHIFT_ARROW_LEFT) {
+        if (!C.block) {
+            C.block = true;
+            C.n = 0;
+            C.blockRow = E.cy;
+            C.blockRx = editorCursorRx();
+        }
+        if (key == CTRL_SHIFT_ARROW_RIGHT) key = CTRL_ARROW_RIGHT;
+        else if (key == CTRL_SHIFT_ARROW_LEFT) key = CTRL_ARROW_LEFT;
+        else key = plain[key - SHIFT_ARROW_UP];
+    } else {
+        C.block = false;
+    }
+
+    const char *row = E.cy < E.numrows ? editorRowAt(E.cy, &len) : NULL;
+
+    switch (key) {
+        case ARROW_LEFT:
+            if (E.cx > 0) {
+                E.cx = editorPrevCluster(row, len, E.cx);
+            } else if (E.cy > 0) {
+                E.cy--;
+                editorRowAt(E.cy, &E.cx);
+            }
+            return;
+        case ARROW_RIGHT:
+            if (row && E.cx < len) {
+                E.cx = editorClusterStep(row, len, E.cx, 0, &w);
+            } else if (row && E.cx == len) {
+                E.cy++;
+                E.cx = 0;
+            }
+            return;
+        case CTRL_ARROW_RIGHT:
+        case CTRL_ARROW_LEFT:
+            editorOffsetToCursor(wordOffset(editorCursorOffset(), key == CTRL_ARROW_LEFT ? -1 : 1),
+                                 &E.cy, &E.cx);
+            return;
+        case ARROW_UP:
+            editorMoveRows(-1);
+            return;
+        case ARROW_DOWN:
+            editorMoveRows(1);
+            return;
+    }
+}
+
+/*
+ * Moves every cursor for a horizontal motion key: the one in E as
+ * editorMoveCursor does, the extra ones the same way through their
+ * document offsets.
+ * Args:
+ *   key - ARROW_LEFT, ARROW_RIGHT, their Ctrl forms, HOME_KEY or END_KEY.
+ */
+static void editorMoveCursors(int key) {
+    for (size_t i = 0; i < C.n; i++) {
+        size_t off = C.offs[i];
+        if (key == ARROW_LEFT || key == ARROW_RIGHT) {
+            C.offs[i] = editorStepOffset(off, key == ARROW_LEFT ? -1 : 1);
+            continue;
+        }
+        if (key == CTRL_ARROW_LEFT || key == CTRL_ARROW_RIGHT) {
+            C.offs[i] = wordOffset(off, key == CTRL_ARROW_LEFT ? -1 : 1);
+            continue;
+        }
+
+        long cy;
+        int cx, len = 0;
+        editorOffsetToCursor(off, &cy, &cx);
+        if (cy < E.numrows && key == END_KEY) editorRowAt(cy, &len);
+        C.offs[i] = off - cx + len;
+    }
+
+    if (key == HOME_KEY || key == END_KEY) C.block = false;
+    if (key == HOME_KEY) E.cx = 0;
+    else if (key == END_KEY && E.cy < E.numrows) editorRowAt(E.cy, &E.cx);
+    else editorMoveCursor(key);
+    cursorNormalize();
+}
+
+/*
+ * Leaves a cursor where the one in E is and moves that one a row up or
+ * down, keeping its column.
+ * Args:
+ *   dir - -1 for up, 1 for down.
+ */
+static void editorAddCursor(int dir) {
+    size_t off = editorCursorOffset();
+    long cy = E.cy;
+    editorMoveRows(dir);
+    if (E.cy == cy) return;
+    cursorInsert(off);
+    cursorNormalize();
+}
+
+/*
+ * Folds or unfolds at the cursor. On the row a fold is shown at, the
+ * fold opens. Otherwise the rows of the block selection are folded, or
+ * without one the innermost JSON object or array around the cursor that
+ * spans rows, found through the structural index.
+ */
+static void editorFoldToggle(void) {
+    if (E.cy >= E.numrows) return;
+    size_t k = foldBefore(E.cy);
+    if (k < F.n && F.folds[k].first == E.cy) {
+        foldRemove(k);
+        return;
+    }
+
+    long first = 0, last = 0;
+    if (C.block) {
+        int c0, c1;
+        editorBlockBounds(editorCursorRx(), &first, &last, &c0, &c1);
+        C.block = false;
+        E.cy = first;
+        editorClampCursor();
+    } else {
+        jsonIndexBuild();
+        size_t off = editorCursorOffset();
+        uint32_t m = jsonMarksBefore(off + 1), c = JSON_NONE; // A bracket under the cursor counts
+        if (m) {
+            const struct jsonMark *mk = &J.marks[m - 1];
+            if (mk->c == '{' || mk->c == '[') c = m - 1;
+            else if (mk->c != ',' && mk->off == off) c = mk->match;
+            else c = mk->parent;
+        }
+        for (; c != JSON_NONE; c = J.marks[c].parent) {
+            if (J.marks[c].match == JSON_NONE) continue;
+            first = editorRowAtOffset(J.marks[c].off);
+            last = editorRowAtOffset(J.marks[J.marks[c].match].off);
+            if (last > first) break;
+        }
+        if (c == JSON_NONE) {
+            editorSetStatusMessage("Nothing to fold: select rows with Shift and the arrows");
+            return;
+        }
+        editorOffsetToCursor(J.marks[c].off, &E.cy, &E.cx);
+    }
+    foldAdd(first, last);
+}
+
+/*
+ * Switches the shown document in or out of table mode, where delimited
+ * rows are drawn as aligned columns.
+ */
+static void editorToggleTable(void) {
+    if (E.numrows == 0) return;
+    C.block = false; // Its columns were measured in the other layout
+    tableStart(!G.on);
+    if (!G.on) editorSetStatusMessage("Table mode off");
+    else if (G.delim == '\t') editorSetStatusMessage("Table mode: fields split at tabs");
+    else editorSetStatusMessage("Table mode: fields split at '%c'", G.delim);
+}
+
+/*
+ * Processes a single keypress and updates editor state.
+ */
+static void editorDispatchKey(int c) {
+    uint64_t start = traceBegin();
+
+    if (E.promptLabel && c != CTRL_KEY('q')) {
+        editorPromptKey(c);
+        traceEnd("key dispatch", start, c);
+        return;
+    }
+    if (V.prefix) {
+        V.prefix = false;
+        paneCommand(c);
+        traceEnd("key dispatch", start, c);
+        return;
+    }
+
+    if (c != PAGE_UP && c != PAGE_DOWN) E.pageStreak = 0;
+    if (c != CTRL_KEY('q')) E.quitConfirm = false;
+    if (c == '\r' || c == '\t' || (c >= ' ' && c < BACKSPACE) || (c > BACKSPACE && c <= UCHAR_MAX) ||
+        (c < 0 && c >= CHAR_MIN)) {
+        editorTypeChar(c == '\r' ? '\n' : c);
+        traceEnd("key dispatch", start, c);
+        return;
+    }
+    editorFlushTyped();
+
+    switch (c) {
+        case CTRL_KEY('g'):
+            editorPromptStart("Go to line, N%% or @offset: %s", editorGotoDone);
+            break;
+        case CTRL_KEY('n'):
+            if (B.nbufs > 1) bufferSwitch((B.current + 1) % B.nbufs);
+            break;
+        case CTRL_KEY('b'):
+            if (B.nbufs > 1) bufferSwitch((B.current + B.nbufs - 1) % B.nbufs);
+            break;
+        case CTRL_KEY('w'):
+            V.prefix = true;
+            break;
+        case CTRL_KEY('p'):
+            E.hud = !E.hud;
+            break;
+        case CTRL_KEY('t'):
+            editorToggleTable();
+            break;
+        case CTRL_KEY(']'):
+            editorJsonJump();
+            break;
+        case CTRL_KEY('k'):
+            editorFoldToggle();
+            break;
+        case CTRL_KEY('y'):
+            editorJsonShowPath();
+            break;
+        case CTRL_KEY('s'):
+            editorSave();
+            break;
+        case CTRL_KEY('q'):
+            if (editorUnsaved() && !E.quitConfirm) {
+                editorSetStatusMessage("Unsaved changes: Ctrl-S saves, Ctrl-Q again quits");
+                E.quitConfirm = true;
+                break;
+            }
+            writerDrain(1000);
+            write(STDOUT_FILENO, "\x1b[2J", 4);
+            write(STDOUT_FILENO, "\x1b[H", 3);
+            exit(0);
+            break;
+        case HOME_KEY:  // moves cursor to the start of the row
+        case END_KEY:   // moves cursor to the end of the row
+            editorMoveCursors(c);
+            break;
+        case BACKSPACE:
+        case CTRL_KEY('h'):
+            editorDeleteChar(-1);
+            break;
+        case DEL_KEY:
+            editorDeleteChar(1);
+            break;
+        case '\x1b':
+            C.n = 0;
+            C.block = false;
+            break;
+        case CTRL_KEY('c'):
+            if (C.block) editorBlockCopy();
+            else editorSetStatusMessage("Select a block with Shift and the arrow keys first");
+            break;
+        case CTRL_KEY('v'):
+            editorBlockPaste();
+            break;
+        case CTRL_ARROW_UP:
+            editorAddCursor(-1);
+            break;
+        case CTRL_ARROW_DOWN:
+            editorAddCursor(1);
+            break;
+        case PAGE_UP:
+        case PAGE_DOWN:
+            {
+                int dir = c == PAGE_UP ? -1 : 1;
+                editorMoveRows((long)dir * E.screenRows);
+
+                // Read ahead in the direction of travel, further the longer it lasts
+                E.pageStreak = E.pageStreak * dir > 0 ? E.pageStreak + dir : dir;
+                long ahead = (long)E.screenRows *
+                    (abs(E.pageStreak) < PREFETCH_MAX_SCREENS ? abs(E.pageStreak) : PREFETCH_MAX_SCREENS);
+                if (dir > 0) editorPrefetchRows(E.cy + 1, E.cy + ahead);
+                else editorPrefetchRows(E.cy - ahead, E.cy - 1);
+            }
+            break;
+        case ARROW_UP:
+        case ARROW_DOWN:
+        case SHIFT_ARROW_UP:
+        case SHIFT_ARROW_DOWN:
+        case SHIFT_ARROW_RIGHT:
+        case SHIFT_ARROW_LEFT:
+        case CTRL_SHIFT_ARROW_RIGHT:
+        case CTRL_SHIFT_ARROW_LEFT:
+            editorMoveCursor(c);
+            break;
+        case ARROW_LEFT:
+        case ARROW_RIGHT:
+        case CTRL_ARROW_LEFT:
+        case CTRL_ARROW_RIGHT:
+            editorMoveCursors(c);
+            break;
+    }
+    traceEnd("key dispatch", start, c);
+}
+
+/*
+ * Reads a single keypress, records it if requested, and updates editor state.
+ */
+static void editorProcessKeyPress() {
+    uint64_t start = traceBegin();
+    int c = editorReadKey();
+    traceEnd("key read", start, c);
+    if (L.fp) inputLogKey(c);
+    editorDispatchKey(c);
+}
+
+/*** Frame Scheduling ***/
+
+/*
+ * Waits until standard input is readable, flushing pending output
+ * whenever the terminal can take more of it.
+ * Args:
+ *   timeoutMs - Maximum wait in milliseconds, -1 to wait forever.
+ * Returns:
+ *   true if input is pending, false on timeout or after an output event.
+ */
+static bool editorInputPending(int timeoutMs) {
+    struct pollfd pfds[4] = {{STDIN_FILENO, POLLIN, 0}, {E.inotifyFd, POLLIN, 0},
+                             {E.gz ? E.gz->notify[0] : -1, POLLIN, 0},
+                             {W.fd, writerPending() ? POLLOUT : 0, 0}};
+    int ready = poll(pfds, 4, timeoutMs); // Negative descriptors are skipped
+    if (ready == -1) {
+        if (errno != EINTR) die("poll");
+        return false;
+    }
+    if (pfds[1].revents) editorFollowEvents();
+    if (pfds[2].revents) editorGzUpdate();
+    if (pfds[3].revents) writerFlush();
+    return pfds[0].revents != 0;
+}
+
+/*
+ * Returns the current frame interval. It never drops below twice the
+ * measured write latency, so a slow terminal link is not kept busy with
+ * frames it cannot absorb.
+ */
+static uint64_t editorFrameInterval(void) {
+    uint64_t adaptive = 2 * E.writeLatency;
+    return adaptive > E.frameInterval ? adaptive : E.frameInterval;
+}
+
+/*
+ * Runs the editor: drains all pending input before drawing, and draws at
+ * most once per frame interval, so key repeat never queues up frames.
+ */
+static void editorFrameLoop(void) {
+    E.dirty = true;
+    while (true) {
+        int timeoutMs = -1;
+        if (E.dirty) {
+            uint64_t now = monotonicNs();
+            uint64_t due = E.lastFrame + editorFrameInterval();
+            if (now >= due) {
+                editorFlushTyped();
+                editorRefreshScreen();
+                E.dirty = false;
+                continue;
+            }
+            timeoutMs = (due - now + NSEC_PER_MSEC - 1) / NSEC_PER_MSEC;
+        }
+        // The overlay refreshes on its own while it is shown
+        if (E.hud && timeoutMs == -1) timeoutMs = HUD_REFRESH_MS;
+        if (!editorInputPending(timeoutMs)) {
+            if (E.hud && timeoutMs == HUD_REFRESH_MS) E.dirty = true;
+            continue;
+        }
+
+        // Coalesce queued keys, but draw at least once per interval under a flood
+        uint64_t deadline = monotonicNs() + editorFrameInterval();
+        do {
+            editorProcessKeyPress();
+            E.dirty = true;
+        } while (editorInputPending(0) && monotonicNs() < deadline);
+    }
+}
+
+/*
+ * Replays a recording as fast as possible without a terminal: every key
+ * is dispatched and followed by a frame, which is written to /dev/null.
+ * Prints the total time and where it went, then exits.
+ */
+static void editorReplay(void) {
+    uint64_t dispatchNs = 0, buildNs = 0, writeNs = 0;
+    long keys = 0;
+    int c;
+
+    uint64_t start = monotonicNs();
+    editorRefreshScreen();
+    while (inputLogNextKey(&c) && c != CTRL_KEY('q')) {
+        uint64_t t = monotonicNs();
+        editorDispatchKey(c);
+        editorFlushTyped();
+        dispatchNs += monotonicNs() - t;
+        editorRefreshScreen();
+        buildNs += P.lastBuildNs;
+        writeNs += P.lastWriteNs;
+        keys++;
+    }
+    uint64_t total = monotonicNs() - start;
+
+    double ms = 1.0 / NSEC_PER_MSEC, us = 1e-3;
+    printf("Replayed %ld keys from %s in %.3f ms (recorded session: %.3f s)\n",
+           keys, L.path, total * ms, L.recordedUs / 1e6);
+    printf("  key dispatch %10.3f ms  %8.2f us/key\n", dispatchNs * ms,
+           keys ? dispatchNs * us / keys : 0.0);
+    printf("  frame build  %10.3f ms  %8.2f us/key\n", buildNs * ms,
+           keys ? buildNs * us / keys : 0.0);
+    printf("  write        %10.3f ms  %8.2f us/key\n", writeNs * ms,
+           keys ? writeNs * us / keys : 0.0);
+    exit(EXIT_SUCCESS);
+}
+
+/*** Initialization ***/
+
+/*
+ * Initializes the editor configuration with screen size and cursor position.
+ */
+static void initEditor(void) {
+    E.cx = 0;
+    E.cy = 0;
+    E.rx = 0;
+    E.rowoff = 0;
+    E.coloff = 0;
+    E.numrows = 0;
+    E.lineIdx = NULL;
+    E.lineRow = NULL;
+    E.lineSlots = 0;
+    E.lineCap = 0;
+    E.lineMapLen = 0;
+    E.map = NULL;
+    E.mapLen = 0;
+    E.fd = -1;
+    E.filename = NULL;
+    E.gz = NULL;
+    E.inotifyFd = E.fileWatch = E.dirWatch = -1;
+    E.dirty = false;
+    E.version = 0;
+    E.lastFrame = 0;
+    E.writeLatency = 0;
+    E.hud = false;
+    E.pageStreak = 0;
+    E.docLen = 0;
+    E.pt = NULL;
+    E.quitConfirm = false;
+    E.statusmsg[0] = '\0';
+    E.statusmsgTime = 0;
+    E.promptLabel = NULL;
+
+    int fps = DEFAULT_FPS;
+    char *env = getenv("LEKHANI_FPS");
+    if (env && atoi(env) > 0) fps = atoi(env);
+    E.frameInterval = NSEC_PER_SEC / fps;
+
+    writerInit();
+    budgetInit();
+
+    initCharWidths();
+    initWordClasses();
+    renderCacheInit();
+    if (!L.replay && getWindowSize(&E.termRows, &E.termCols) == -1) {
+        die("getWindowSize");
+    }
+    paneInit();
+    editorInvalidateScreen();
+}
+
+/*** Entry Point ***/
+
+/*
+ * Main function: initializes and runs the editor.
+ * Args:
+ *   argc - Number of command-line arguments.
+ *   argv - Array of argument strings.
  * Returns:
  *   EXIT_SUCCESS on successful execution.
  */
@@ -415,13 +6587,18 @@ int main(int argc, char *argv[]) {
     if (checkVersionFlag(argc, argv)) {
         return EXIT_SUCCESS;
     }
+    int argi = checkOptionFlags(argc, argv);
 
-    enableRawMode();
+    if (!L.replay) enableRawMode();
     initEditor();
-    while (true) {
-        editorRefreshScreen();
-        editorProcessKeyPress();
+    if (argc > argi) {
+        bufferInit(argc - argi);
+        for (int i = argi; i < argc; i++) bufferAdd(argv[i]);
+        bufferSwitch(0);
     }
+    if (L.replay) editorReplay();
+    if (L.fp) inputLogHeader();
+    editorFrameLoop();
 
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}